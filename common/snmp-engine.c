@@ -36,6 +36,11 @@
  *
  */
 
+/* For recvmmsg() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "usuals.h"
 
 #include "async-resolver.h"
@@ -48,6 +53,9 @@
 #include <sys/socket.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <err.h>
@@ -64,6 +72,78 @@ typedef uint64_t mstime;
 
 /* Forward declarations */
 static void request_release (struct request *req);
+static void walk_response (int request, int code, struct snmp_value *value, void *arg);
+static void walk_dispatch (void *arg, struct snmp_pdu *pdu);
+static void host_alive (struct host *host);
+static void host_failed (struct host *host, mstime when);
+static void host_latency (struct host *host, mstime latency);
+static int host_probe_timer (mstime when, void *arg);
+
+/* ------------------------------------------------------------------------------
+ * RATE LIMITING
+ */
+
+/*
+ * Token buckets count in thousandths of a packet. A rate in packets per
+ * second is then also the number of tokens added each millisecond.
+ */
+#define BUCKET_PACKET 1000
+
+struct bucket {
+	uint rate;                /* Packets per second, zero for unlimited */
+	mstime burst;             /* The most tokens we save up */
+	mstime tokens;            /* Thousandths of packets we can send */
+	mstime filled;            /* When tokens were last added */
+};
+
+/* Requests waiting their turn to be sent, in order */
+struct queue {
+	struct request *first;
+	struct request *last;
+	int count;
+};
+
+/* The limit on all packets we send */
+static struct bucket snmp_bucket = { 0, 0, 0, 0 };
+
+/* New requests are released at this rate */
+static struct bucket snmp_pace = { 0, 0, 0, 0 };
+static struct queue snmp_paced = { NULL, NULL, 0 };
+static uint snmp_pace_percent = 0;
+static int snmp_pace_pending = 0;
+
+static void
+bucket_rate (struct bucket *bucket, uint rate, mstime burst)
+{
+	bucket->rate = rate;
+	bucket->burst = burst;
+}
+
+static int
+bucket_ready (struct bucket *bucket, mstime when)
+{
+	if (!bucket->rate)
+		return 1;
+
+	if (when > bucket->filled) {
+		bucket->tokens += (when - bucket->filled) * bucket->rate;
+		if (bucket->tokens > bucket->burst)
+			bucket->tokens = bucket->burst;
+		bucket->filled = when;
+	}
+
+	return bucket->tokens >= BUCKET_PACKET;
+}
+
+static void
+bucket_take (struct bucket *bucket)
+{
+	if (!bucket->rate)
+		return;
+
+	ASSERT (bucket->tokens >= BUCKET_PACKET);
+	bucket->tokens -= BUCKET_PACKET;
+}
 
 /* ------------------------------------------------------------------------------
  * HOSTS
@@ -93,6 +173,28 @@ struct host {
 	/* Requests that are queued of this host */
 	struct request *prepared;
 
+	/* GET requests prepared or sent to this host, by OID */
+	hsh_t *inflight;
+
+	/* Packets to this host are limited, and wait in order */
+	uint throttle;
+	struct queue queue;
+
+	/* Polls in a row without any response, see host_failed() */
+	uint failed_polls;
+	mstime failed_at;
+	mstime responded_at;
+
+	/* When down only a probe is sent, less often each time */
+	int is_down;
+	int is_probing;
+	mstime probe_at;
+	mstime probe_backoff;
+
+	/* Smoothed response time, see host_latency() */
+	mstime latency;
+	mstime latency_at;
+
 	/* Next in list of hosts */
 	struct host *next;
 };
@@ -103,6 +205,65 @@ static struct host *host_list = NULL;
 /* Hosts hashed by the host:version:community string */
 static hsh_t *host_by_key = NULL;
 
+/* Addresses from a previous run, numeric strings by host name */
+static hsh_t *host_remembered = NULL;
+
+/* Response times from a previous run, by host name within */
+struct remembered_latency {
+	mstime latency;
+	mstime at;
+	char hostname[1];
+};
+
+static hsh_t *latency_remembered = NULL;
+
+/*
+ * Hosts with the same address share a budget, even when polled with
+ * another community or SNMP version. Keyed by the address within.
+ */
+struct shared_bucket {
+	struct sockaddr_storage address;
+	socklen_t address_len;
+	struct bucket bucket;
+};
+
+static hsh_t *bucket_by_address = NULL;
+
+static struct bucket*
+host_bucket (struct host *host)
+{
+	struct shared_bucket *shared;
+
+	if (!host->is_resolved)
+		return NULL;
+
+	shared = hsh_get (bucket_by_address, &host->address, host->address_len);
+	if (!shared) {
+		if (!host->throttle)
+			return NULL;
+
+		shared = calloc (1, sizeof (struct shared_bucket));
+		if (!shared) {
+			log_error ("out of memory");
+			return NULL;
+		}
+
+		memcpy (&shared->address, &host->address, host->address_len);
+		shared->address_len = host->address_len;
+		if (!hsh_set (bucket_by_address, &shared->address, shared->address_len, shared)) {
+			log_error ("out of memory");
+			free (shared);
+			return NULL;
+		}
+	}
+
+	/* The lowest rate of all the hosts wins, with a burst of one second */
+	if (host->throttle && (!shared->bucket.rate || host->throttle < shared->bucket.rate))
+		bucket_rate (&shared->bucket, host->throttle, host->throttle * BUCKET_PACKET);
+
+	return &shared->bucket;
+}
+
 static void
 resolve_cb (int ecode, struct addrinfo *ai, void *arg)
 {
@@ -204,6 +365,53 @@ host_update_interval (struct host *host, mstime interval)
 	}
 }
 
+/* Use an address from a previous run, until the host name resolves */
+static void
+host_remember (struct host *host)
+{
+	struct addrinfo hints, *ai;
+	const char *address;
+
+	address = hsh_get (host_remembered, host->hostname, -1);
+	if (!address)
+		return;
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_NUMERICHOST;
+
+	if (getaddrinfo (address, host->portnum, &hints, &ai) != 0)
+		return;
+
+	if (ai->ai_addrlen <= sizeof (host->address)) {
+		memcpy (&host->address, ai->ai_addr, ai->ai_addrlen);
+		host->address_len = ai->ai_addrlen;
+
+		/* Expires like any other resolved address */
+		host->last_resolved = server_get_time ();
+		host->is_resolved = 1;
+
+		log_debug ("using remembered address for host: %s: %s", host->hostname, address);
+	}
+
+	freeaddrinfo (ai);
+}
+
+static void
+host_remember_latency (struct host *host)
+{
+	struct remembered_latency *rl;
+
+	rl = hsh_get (latency_remembered, host->hostname, -1);
+	if (!rl)
+		return;
+
+	/* Still forgiven over time, from when it was last noted */
+	host->latency = rl->latency;
+	host->latency_at = rl->at;
+}
+
 static struct host*
 host_instance (const char *hostname, const char *portnum,
                const char *community, int version, mstime interval)
@@ -255,10 +463,13 @@ host_instance (const char *hostname, const char *portnum,
 		}
 
 		host = calloc (1, sizeof (struct host));
-		if (!host) {
+		if (host)
+			host->inflight = hsh_create ();
+		if (!host || !host->inflight) {
 			log_errorx ("out of memory");
 			if (ai != NULL)
 				freeaddrinfo (ai);
+			free (host);
 			return NULL;
 		}
 
@@ -277,6 +488,7 @@ host_instance (const char *hostname, const char *portnum,
 		memcpy (&host->key, key, sizeof (host->key));
 		if (!hsh_set (host_by_key, host->key, -1, host)) {
 			log_errorx ("out of memory");
+			hsh_free (host->inflight);
 			free (host);
 			return NULL;
 		}
@@ -293,6 +505,11 @@ host_instance (const char *hostname, const char *portnum,
 		host->last_resolved = 0;
 		host->last_resolve_try = 0;
 
+		/* A previous run may know the address, the resolve timer checks it */
+		if (host->must_resolve)
+			host_remember (host);
+		host_remember_latency (host);
+
 		/* Start the resolving process */
 		if (!host->is_resolved)
 			host_resolve (host, server_get_time ());
@@ -301,6 +518,10 @@ host_instance (const char *hostname, const char *portnum,
 	/* Update the host's resolve interval based on the poll interval requested */
 	host_update_interval (host, interval);
 
+	/* The shortest poll interval of the host */
+	if (!host->interval || interval < host->interval)
+		host->interval = interval;
+
 	return host;
 }
 
@@ -312,20 +533,62 @@ host_initialize (void)
 	if (!host_by_key)
 		err (1, "out of memory");
 
+	host_remembered = hsh_create ();
+	if (!host_remembered)
+		err (1, "out of memory");
+
+	latency_remembered = hsh_create ();
+	if (!latency_remembered)
+		err (1, "out of memory");
+
+	bucket_by_address = hsh_create ();
+	if (!bucket_by_address)
+		err (1, "out of memory");
+
 	/* resolve timer goes once per second */
 	if (server_timer (1000, host_resolve_timer, NULL) == -1)
 		err (1, "couldn't setup resolve timer");
+
+	/* And so does the one that probes hosts that are down */
+	if (server_timer (1000, host_probe_timer, NULL) == -1)
+		err (1, "couldn't setup probe timer");
 }
 
 static void
 host_cleanup (void)
 {
 	struct host *next, *host;
+	const void *key;
+	hsh_index_t *i;
 
 	if (host_by_key)
 		hsh_free (host_by_key);
 	host_by_key = NULL;
 
+	/* Key and address are in the same block */
+	if (host_remembered) {
+		for (i = hsh_first (host_remembered); i; i = hsh_next (i)) {
+			hsh_this (i, &key, NULL);
+			free ((void*)key);
+		}
+		hsh_free (host_remembered);
+	}
+	host_remembered = NULL;
+
+	if (latency_remembered) {
+		for (i = hsh_first (latency_remembered); i; i = hsh_next (i))
+			free (hsh_this (i, NULL, NULL));
+		hsh_free (latency_remembered);
+	}
+	latency_remembered = NULL;
+
+	if (bucket_by_address) {
+		for (i = hsh_first (bucket_by_address); i; i = hsh_next (i))
+			free (hsh_this (i, NULL, NULL));
+		hsh_free (bucket_by_address);
+	}
+	bucket_by_address = NULL;
+
 	for (host = host_list; host; host = next) {
 		next = host->next;
 		if (host->hostname)
@@ -336,6 +599,7 @@ host_cleanup (void)
 			free (host->community);
 		if (host->prepared)
 			request_release (host->prepared);
+		hsh_free (host->inflight);
 		free (host);
 	}
 
@@ -346,6 +610,9 @@ host_cleanup (void)
  * ASYNC REQUEST PROCESSING
  */
 
+#define CALLBACK_ACTIVE(req, cb) \
+	((req)->callbacks[cb].func || (req)->callbacks[cb].batch)
+
 #define MAKE_REQUEST_ID(snmp, cb) \
 	((((snmp) & 0xFFFFFF) << 8) | (cb & 0xFF))
 #define REQUEST_ID_SNMP(id) \
@@ -366,15 +633,27 @@ struct request
 
 	struct host *host;        /* Host associated with this request */
 
-	/* One callback entry for each binding */
+	mstime interval;          /* The poll interval */
+	mstime prepared_at;       /* When it started taking bindings */
+
+	struct queue *queued;     /* Waiting to be sent on this queue */
+	mstime queued_at;         /* When it started waiting */
+	struct request *queued_next;
+
+	/* One callback entry for each binding, either func or batch is set */
 	struct {
 		snmp_response func;
+		snmp_batch_response batch;
 		void *arg;
+		void *cookie;             /* Only for batch callbacks */
 	} callbacks[SNMP_MAX_BINDINGS];
 
 	/* One flag for each binding */
 	int is_duplicate[SNMP_MAX_BINDINGS];
 
+	/* Where each binding is in the packet sent, duplicates share one */
+	int position[SNMP_MAX_BINDINGS];
+
 	int duplicates;           /* Total number of duplicate bindings */
 
 	/* The actual request data */
@@ -412,6 +691,125 @@ static hsh_t *snmp_preparing = NULL;
 /* A flush of prepared packets is pending */
 static int snmp_flush_pending = 0;
 
+/* How long prepared packets stay open to more bindings */
+static mstime snmp_coalesce = 0;
+
+/* Number of requests waiting on host rate limits */
+static int snmp_throttled = 0;
+
+/* Polls without response before a host is down, or zero */
+static uint snmp_breaker = 0;
+
+/* A probe is being sent, see host_probe() */
+static int snmp_probing = 0;
+
+/*
+ * The hash key for an OID. The hash table doesn't copy keys, so these
+ * point into a PDU that outlives the table entry.
+ */
+#define OID_KEY(oid) \
+	((oid)->subs), ((oid)->len * sizeof (asn_subid_t))
+
+static void
+request_inflight_add (struct request *req, int binding)
+{
+	struct asn_oid *oid;
+
+	ASSERT (req->pdu.type == SNMP_PDU_GET);
+	ASSERT (!req->is_duplicate[binding]);
+
+	oid = &req->pdu.bindings[binding].var;
+
+	/* An earlier request, which is full, may already be waiting for this */
+	if (hsh_get (req->host->inflight, OID_KEY (oid)))
+		return;
+
+	/* Not fatal, we just don't share this binding */
+	if (!hsh_set (req->host->inflight, OID_KEY (oid), req))
+		log_errorx ("out of memory");
+}
+
+static int
+request_position (struct request *req, struct asn_oid *oid)
+{
+	int i;
+
+	/* The binding that was not a duplicate */
+	for (i = 0; i < req->pdu.nbindings; ++i) {
+		if (!req->is_duplicate[i] &&
+		    asn_compare_oid (&(req->pdu.bindings[i].var), oid) == 0)
+			return req->position[i];
+	}
+
+	ASSERT (0 && "duplicate binding without original");
+	return -1;
+}
+
+static void
+request_inflight_remove (struct request *req)
+{
+	struct asn_oid *oid;
+	int i;
+
+	if (req->pdu.type != SNMP_PDU_GET)
+		return;
+
+	for (i = 0; i < req->pdu.nbindings; ++i) {
+		if (req->is_duplicate[i])
+			continue;
+		oid = &req->pdu.bindings[i].var;
+		if (hsh_get (req->host->inflight, OID_KEY (oid)) == req)
+			hsh_rem (req->host->inflight, OID_KEY (oid));
+	}
+}
+
+static void
+request_queue (struct queue *queue, struct request *req, mstime when)
+{
+	ASSERT (!req->queued);
+
+	req->queued = queue;
+	req->queued_at = when;
+	req->queued_next = NULL;
+	if (queue->last)
+		queue->last->queued_next = req;
+	else
+		queue->first = req;
+	queue->last = req;
+	queue->count++;
+
+	if (queue != &snmp_paced)
+		++snmp_throttled;
+}
+
+static void
+request_unqueue (struct request *req)
+{
+	struct queue *queue = req->queued;
+	struct request *prev;
+
+	ASSERT (queue);
+
+	if (queue->first == req) {
+		prev = NULL;
+		queue->first = req->queued_next;
+	} else {
+		for (prev = queue->first; prev->queued_next != req; prev = prev->queued_next)
+			ASSERT (prev->queued_next);
+		prev->queued_next = req->queued_next;
+	}
+
+	if (queue->last == req)
+		queue->last = prev;
+	queue->count--;
+
+	if (queue != &snmp_paced)
+		--snmp_throttled;
+
+	req->queued = NULL;
+	req->queued_next = NULL;
+}
+
 static void
 request_release_all (hsh_t * hsh_req)
 {
@@ -446,6 +844,9 @@ request_release (struct request *req)
 	ASSERT (!hsh_get (snmp_preparing, &req->snmp_id, sizeof (req->snmp_id)));
 	ASSERT (!hsh_get (snmp_processing, &req->snmp_id, sizeof (req->snmp_id)));
 
+	if (req->queued)
+		request_unqueue (req);
+	request_inflight_remove (req);
 	snmp_pdu_clear (&req->pdu);
 	free (req);
 }
@@ -518,6 +919,60 @@ request_send (struct request* req, mstime when)
 	}
 }
 
+/*
+ * Hands the batch bindings of a request back to their callers, one call
+ * for each batch in the request. Returns zero if the request was freed
+ * by one of the callbacks.
+ */
+static int
+request_batch_dispatch (struct request *req, int code, struct snmp_value **values)
+{
+	struct snmp_batch batch[SNMP_MAX_BINDINGS];
+	snmp_batch_response func;
+	void *arg;
+	int i, j, count;
+	int snmp_id;
+
+	/* Remember snmp_id in case req is freed by the callback */
+	snmp_id = req->snmp_id;
+
+	for (j = 0; j < req->pdu.nbindings; ++j) {
+
+		if (!req->callbacks[j].batch)
+			continue;
+
+		func = req->callbacks[j].batch;
+		arg = req->callbacks[j].arg;
+
+		/* Gather all the bindings for this batch */
+		for (i = j, count = 0; i < req->pdu.nbindings; ++i) {
+			if (req->callbacks[i].batch != func || req->callbacks[i].arg != arg)
+				continue;
+			batch[count].oid = &(req->pdu.bindings[i].var);
+			batch[count].cookie = req->callbacks[i].cookie;
+			batch[count].request = MAKE_REQUEST_ID (snmp_id, i);
+			batch[count].value = values ? values[i] : NULL;
+			++count;
+
+			/* Cancelling these from the callback does nothing */
+			req->callbacks[i].batch = NULL;
+			req->callbacks[i].arg = NULL;
+			req->callbacks[i].cookie = NULL;
+		}
+
+		(func) (code, batch, count, arg);
+
+		/*
+		 * Request could have been freed by the callback, by calling the cancel
+		 * function, check and bail if so.
+		 */
+		if (hsh_get (snmp_processing, &snmp_id, sizeof (snmp_id)) != req)
+			return 0;
+	}
+
+	return 1;
+}
+
 static void
 request_failure (struct request *req, int code)
 {
@@ -534,6 +989,9 @@ request_failure (struct request *req, int code)
     /* Remember snmp_id in case req is freed by the callback */
     snmp_id = req->snmp_id;
 
+	/* Callbacks that request these again must not be attached to this request */
+	request_inflight_remove (req);
+
 	/* For each request SNMP value... */
 	for (j = 0; j < req->pdu.nbindings; ++j) {
 
@@ -552,6 +1010,10 @@ request_failure (struct request *req, int code)
 			return;
 	}
 
+	/* And then each batch in one go */
+	if (!request_batch_dispatch (req, code, NULL))
+		return;
+
 	/* Remove from the processing list */
 	val = hsh_rem (snmp_processing, &req->snmp_id, sizeof (req->snmp_id));
 	ASSERT (val == req);
@@ -560,12 +1022,44 @@ request_failure (struct request *req, int code)
 	request_release (req);
 }
 
+/*
+ * Finds the value for an OID in a response, when it's not where we put
+ * it in the request. The index is built on first use.
+ */
+static struct snmp_value*
+response_lookup (hsh_t **index, struct snmp_pdu *pdu, struct asn_oid *oid)
+{
+	struct snmp_value *pvalue;
+	int i;
+
+	if (!*index) {
+		*index = hsh_create ();
+		if (!*index) {
+			log_errorx ("out of memory");
+			return NULL;
+		}
+
+		/* With duplicate OIDs in the response, the first one wins */
+		for (i = 0; i < pdu->nbindings; ++i) {
+			pvalue = &(pdu->bindings[i]);
+			if (!hsh_get (*index, OID_KEY (&pvalue->var)) &&
+			    !hsh_set (*index, OID_KEY (&pvalue->var), pvalue))
+				log_errorx ("out of memory");
+		}
+	}
+
+	return hsh_get (*index, OID_KEY (oid));
+}
+
 static void
 request_get_dispatch (struct request* req, struct snmp_pdu* pdu)
 {
+	struct snmp_value *values[SNMP_MAX_BINDINGS];
 	struct snmp_value *pvalue;
 	struct snmp_value *rvalue;
-	int i, j, missed, processed;
+	hsh_t *index = NULL;
+	int i, j, missed;
+	int snmp_id;
 	void *val;
 
 	ASSERT (req);
@@ -578,55 +1072,72 @@ request_get_dispatch (struct request* req, struct snmp_pdu* pdu)
 	/*
 	 * For SNMP GET requests we check that the values that came back
 	 * were in fact for the same values we requested, and fix any
-	 * ordering issues etc. See also request_prep_instance deduplication.
+	 * ordering issues etc. See also snmp_engine_request deduplication.
 	 */
+
+	/* Remember snmp_id in case req is freed by the callback */
+	snmp_id = req->snmp_id;
+
+	/* The response is here, any further requests for these OIDs go out anew */
+	request_inflight_remove (req);
+
 	missed = 0;
 	for (j = 0; j < req->pdu.nbindings; ++j) {
 
-		if (!req->callbacks[j].func)
+		values[j] = NULL;
+		if (!CALLBACK_ACTIVE (req, j))
 			continue;
 
 		rvalue = &(req->pdu.bindings[j]);
-		processed = 0;
 
-		/* ... dig out matching value from response */
-		for (i = 0; i < pdu->nbindings; ++i) {
-			pvalue = &(pdu->bindings[i]);
+		/* ... agents nearly always answer in the order we asked */
+		i = req->position[j];
+		pvalue = (i >= 0 && i < pdu->nbindings) ? &(pdu->bindings[i]) : NULL;
+		if (pvalue && asn_compare_oid (&(rvalue->var), &(pvalue->var)) == 0)
+			values[j] = pvalue;
 
-			if (asn_compare_oid (&(rvalue->var), &(pvalue->var)) != 0)
-				continue;
+		/* ... otherwise dig out matching value from response */
+		else
+			values[j] = response_lookup (&index, pdu, &(rvalue->var));
 
-			(req->callbacks[j].func) (MAKE_REQUEST_ID (req->snmp_id, j),
-			                          SNMP_ERR_NOERROR, pvalue, req->callbacks[j].arg);
-			processed = 1;
+		/* Make note that we didn't find a match for at least one binding */
+		if (!values[j])
+			missed = 1;
+	}
 
-			/*
-			 * Request could have been freed by the callback, by calling the cancel
-			 * function, check and bail if so.
-			 */
-			if (hsh_get (snmp_processing, &req->snmp_id, sizeof (req->snmp_id)) != req)
-				return;
+	if (index)
+		hsh_free (index);
 
-			req->callbacks[j].func = NULL;
-			req->callbacks[j].arg = NULL;
-			break;
-		}
+	for (j = 0; j < req->pdu.nbindings; ++j) {
 
-		/* Make note that we didn't find a match for at least one binding */
-		if (!processed && !missed) {
-			missed = 1;
-		}
+		if (!req->callbacks[j].func || !values[j])
+			continue;
+
+		(req->callbacks[j].func) (MAKE_REQUEST_ID (req->snmp_id, j),
+		                          SNMP_ERR_NOERROR, values[j], req->callbacks[j].arg);
+
+		/*
+		 * Request could have been freed by the callback, by calling the cancel
+		 * function, check and bail if so.
+		 */
+		if (hsh_get (snmp_processing, &snmp_id, sizeof (snmp_id)) != req)
+			return;
+
+		req->callbacks[j].func = NULL;
+		req->callbacks[j].arg = NULL;
 	}
 
+	/* Batches get their missing values as NULL */
+	if (!request_batch_dispatch (req, SNMP_ERR_NOERROR, values))
+		return;
+
 	/* All done? */
 	if (!missed)
 		log_debug ("request #%d is complete", req->snmp_id);
 
-    if (hsh_get (snmp_processing, &req->snmp_id, sizeof (req->snmp_id)) == req) {
-		val = hsh_rem (snmp_processing, &req->snmp_id, sizeof (req->snmp_id));
-		ASSERT (val == req);
-		request_release (req);
-	}
+	val = hsh_rem (snmp_processing, &req->snmp_id, sizeof (req->snmp_id));
+	ASSERT (val == req);
+	request_release (req);
 }
 
 static void
@@ -644,26 +1155,33 @@ request_other_dispatch (struct request* req, struct snmp_pdu* pdu)
 	/* Remember snmp_id in case req is freed by the callback */
     snmp_id = req->snmp_id;
 
+	/* Shouldn't have sent more than one binding */
+	ASSERT (req->pdu.nbindings == 1);
+
+	/*
+	 * Walks take all the values that came back, even none, and
+	 * then carry on with their next request.
+	 */
+	if (req->callbacks[0].func == walk_response) {
+		walk_dispatch (req->callbacks[0].arg, pdu);
+
 	/*
 	 * For requests other than GET we just use the first value
 	 * that was sent. See below where we limit to one binding
 	 * per SNMP request when other than GET.
 	 */
-
-	if (pdu->nbindings == 0) {
+	} else if (pdu->nbindings == 0) {
 		log_warn ("received response from the server without any values");
 		return;
-	}
-
-	if (pdu->nbindings > 1)
-		log_warn ("received response from the server with extra values");
 
-	/* Shouldn't have sent more than one binding */
-	ASSERT (req->pdu.nbindings == 1);
+	} else {
+		if (pdu->nbindings > 1)
+			log_warn ("received response from the server with extra values");
 
-	if (req->callbacks[0].func)
-		(req->callbacks[0].func) (MAKE_REQUEST_ID (req->snmp_id, 0), SNMP_ERR_NOERROR,
-						          &(pdu->bindings[0]), req->callbacks[0].arg);
+		if (req->callbacks[0].func)
+			(req->callbacks[0].func) (MAKE_REQUEST_ID (req->snmp_id, 0), SNMP_ERR_NOERROR,
+			                          &(pdu->bindings[0]), req->callbacks[0].arg);
+	}
 
 	log_debug ("request #%d is complete", snmp_id);
 
@@ -671,7 +1189,7 @@ request_other_dispatch (struct request* req, struct snmp_pdu* pdu)
 	 * Request could have been freed by the callback, by calling the cancel
 	 * function, check and bail if so.
 	 */
-	if (hsh_get (snmp_processing, &req->snmp_id, sizeof (req->snmp_id)) != req)
+	if (hsh_get (snmp_processing, &snmp_id, sizeof (snmp_id)) != req)
 		return;
 
 	val = hsh_rem (snmp_processing, &req->snmp_id, sizeof (req->snmp_id));
@@ -679,78 +1197,427 @@ request_other_dispatch (struct request* req, struct snmp_pdu* pdu)
 	request_release (req);
 }
 
-static void
-request_response (int fd, int type, void* arg)
-{
+/* ------------------------------------------------------------------------------
+ * RECEIVING
+ */
+
+/*
+ * Responses are read in batches, with recvmmsg() where there is one. They
+ * can then be decoded by worker threads, see snmp_engine_workers(). All
+ * the matching to requests and callbacks still happen on the main thread,
+ * once the decoded packets are handed back.
+ */
+
+#define RECV_BATCH  32
+
+struct datagram {
 	struct sockaddr_storage from;
-	char hostname[MAXPATHLEN];
+	socklen_t from_len;
+	int len;
+	int decoded;                    /* An SNMP_CODE_xxx */
 	struct snmp_pdu pdu;
+	struct datagram *next;
+	unsigned char data[0x1000];
+};
+
+/* Buffers for the next batch read */
+static struct datagram *recv_batch[RECV_BATCH];
+
+/* The worker threads and their queues */
+static pthread_t *snmp_workers = NULL;
+static int snmp_n_workers = 0;
+static int snmp_workers_quit = 0;
+static pthread_mutex_t snmp_workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t snmp_workers_cond = PTHREAD_COND_INITIALIZER;
+static struct datagram *snmp_decoding = NULL;
+static struct datagram *snmp_decoded = NULL;
+static int snmp_decoded_signal[2] = { -1, -1 };
+
+static void
+datagram_decode (struct datagram *dg)
+{
 	struct asn_buf b;
+	int ip;
+
+	b.asn_ptr = dg->data;
+	b.asn_len = dg->len;
+	dg->decoded = snmp_pdu_decode (&b, &dg->pdu, &ip);
+}
+
+static void
+datagram_response (struct datagram *dg)
+{
+	char hostname[MAXPATHLEN];
 	struct request *req;
 	const char *msg;
-	socklen_t from_len;
-	int len, ret;
-	int ip, id;
-
-	/* Read in the packet */
-	from_len = sizeof (from);
-	len = recvfrom (fd, snmp_buffer, sizeof (snmp_buffer), 0,
-	                (struct sockaddr*)&from, &from_len);
-	if(len < 0) {
-		if(errno != EAGAIN && errno != EWOULDBLOCK)
-			log_error ("error receiving snmp packet from network");
-		return;
-	}
+	int id;
 
-	if (getnameinfo ((struct sockaddr*)&from, from_len,
+	if (getnameinfo ((struct sockaddr*)&dg->from, dg->from_len,
 	                 hostname, sizeof (hostname), NULL, 0,
 	                 NI_NUMERICHOST) != 0)
 		strcpy (hostname, "[UNKNOWN]");
 
-	/* Now parse the packet */
-
-	b.asn_ptr = snmp_buffer;
-	b.asn_len = len;
-
-	ret = snmp_pdu_decode(&b, &pdu, &ip);
-	if (ret != SNMP_CODE_OK) {
+	if (dg->decoded != SNMP_CODE_OK) {
 		log_warnx ("invalid snmp packet received from: %s", hostname);
 		return;
 	}
 
 	/* It needs to match something we're waiting for */
-	id = pdu.request_id;
+	id = dg->pdu.request_id;
 	req = hsh_get (snmp_processing, &id, sizeof (id));
 	if(!req) {
 		log_debug ("received extra, cancelled or delayed packet from: %s", hostname);
-		snmp_pdu_clear (&pdu);
+		snmp_pdu_clear (&dg->pdu);
 		return;
 	}
 
-	if(pdu.version != req->pdu.version)
+	if(dg->pdu.version != req->pdu.version)
 		log_warnx ("wrong version snmp packet from: %s", hostname);
 
+	/* Any response at all means the host is up */
+	host_alive (req->host);
+
+	/* Retries make it unclear which packet this answers */
+	if (req->num_sent == 1)
+		host_latency (req->host, server_get_time () - req->last_sent);
+
 
 	/* Log any errors */
-	if(pdu.error_status == SNMP_ERR_NOERROR) {
+	if(dg->pdu.error_status == SNMP_ERR_NOERROR) {
 		log_debug ("response to request #%d from: %s", req->snmp_id, hostname);
 
 		if (req->pdu.type == SNMP_PDU_GET)
-			request_get_dispatch (req, &pdu);
+			request_get_dispatch (req, &dg->pdu);
 		else
-			request_other_dispatch (req, &pdu);
+			request_other_dispatch (req, &dg->pdu);
 
 	} else {
-		msg = snmp_get_errmsg (pdu.error_status);
+		msg = snmp_get_errmsg (dg->pdu.error_status);
 		if(msg)
 			log_debug ("failure for request #%d from: %s: %s", req->snmp_id, hostname, msg);
 		else
 			log_debug ("failure for request #%d from: %s: %d", req->snmp_id, hostname,
-			           pdu.error_status);
-		request_failure (req, pdu.error_status);
+			           dg->pdu.error_status);
+		request_failure (req, dg->pdu.error_status);
+	}
+
+	snmp_pdu_clear (&dg->pdu);
+}
+
+/* Wake up the main loop, a full pipe means it's awake already */
+static void
+datagram_signal (void)
+{
+	while (write (snmp_decoded_signal[1], "1", 1) != 1) {
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			log_error ("couldn't signal decoded responses");
+		break;
+	}
+}
+
+static void*
+datagram_worker (void *arg)
+{
+	struct datagram *dg;
+
+	for (;;) {
+		pthread_mutex_lock (&snmp_workers_mutex);
+
+			while (!snmp_decoding && !snmp_workers_quit)
+				pthread_cond_wait (&snmp_workers_cond, &snmp_workers_mutex);
+
+			dg = snmp_decoding;
+			if (dg)
+				snmp_decoding = dg->next;
+
+		pthread_mutex_unlock (&snmp_workers_mutex);
+
+		if (!dg)
+			break;
+
+		datagram_decode (dg);
+
+		/* Handed back in any order, they're independent of each other */
+		pthread_mutex_lock (&snmp_workers_mutex);
+
+			dg->next = snmp_decoded;
+			snmp_decoded = dg;
+
+		pthread_mutex_unlock (&snmp_workers_mutex);
+
+		datagram_signal ();
+	}
+
+	return NULL;
+}
+
+static void
+datagram_decoded (int fd, int type, void *arg)
+{
+	struct datagram *dg, *next;
+	char buf[64];
+
+	while (read (fd, buf, sizeof (buf)) > 0);
+
+	pthread_mutex_lock (&snmp_workers_mutex);
+
+		dg = snmp_decoded;
+		snmp_decoded = NULL;
+
+	pthread_mutex_unlock (&snmp_workers_mutex);
+
+	for (; dg; dg = next) {
+		next = dg->next;
+		datagram_response (dg);
+		free (dg);
 	}
+}
 
-	snmp_pdu_clear (&pdu);
+static int
+datagram_receive (int fd)
+{
+	int i, count;
+
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+#endif
+
+	for (i = 0; i < RECV_BATCH; ++i) {
+		if (!recv_batch[i])
+			recv_batch[i] = malloc (sizeof (struct datagram));
+		if (!recv_batch[i])
+			break;
+	}
+
+	count = i;
+	if (!count) {
+		log_errorx ("out of memory");
+		return -1;
+	}
+
+#ifdef HAVE_RECVMMSG
+	memset (msgs, 0, sizeof (msgs));
+	for (i = 0; i < count; ++i) {
+		iovs[i].iov_base = recv_batch[i]->data;
+		iovs[i].iov_len = sizeof (recv_batch[i]->data);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &recv_batch[i]->from;
+		msgs[i].msg_hdr.msg_namelen = sizeof (recv_batch[i]->from);
+	}
+
+	count = recvmmsg (fd, msgs, count, MSG_DONTWAIT, NULL);
+	for (i = 0; i < count; ++i) {
+		recv_batch[i]->len = msgs[i].msg_len;
+		recv_batch[i]->from_len = msgs[i].msg_hdr.msg_namelen;
+	}
+#else
+	recv_batch[0]->from_len = sizeof (recv_batch[0]->from);
+	recv_batch[0]->len = recvfrom (fd, recv_batch[0]->data, sizeof (recv_batch[0]->data),
+	                               0, (struct sockaddr*)&recv_batch[0]->from,
+	                               &recv_batch[0]->from_len);
+	count = recv_batch[0]->len < 0 ? -1 : 1;
+#endif
+
+	return count;
+}
+
+static void
+request_response (int fd, int type, void* arg)
+{
+	struct datagram *dg, *decoding = NULL;
+	int i, count;
+
+	count = datagram_receive (fd);
+	if (count < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			log_error ("error receiving snmp packet from network");
+		return;
+	}
+
+	for (i = 0; i < count; ++i) {
+		dg = recv_batch[i];
+
+		/* Decoded right here */
+		if (!snmp_n_workers) {
+			datagram_decode (dg);
+			datagram_response (dg);
+			continue;
+		}
+
+		/* Or the workers get it, and we need a new buffer */
+		recv_batch[i] = NULL;
+		dg->next = decoding;
+		decoding = dg;
+	}
+
+	if (!decoding)
+		return;
+
+	pthread_mutex_lock (&snmp_workers_mutex);
+
+		for (dg = decoding; dg->next; dg = dg->next);
+		dg->next = snmp_decoding;
+		snmp_decoding = decoding;
+		pthread_cond_broadcast (&snmp_workers_cond);
+
+	pthread_mutex_unlock (&snmp_workers_mutex);
+}
+
+static void
+datagram_cleanup (void)
+{
+	struct datagram *dg;
+	int i;
+
+	if (snmp_n_workers) {
+		pthread_mutex_lock (&snmp_workers_mutex);
+			snmp_workers_quit = 1;
+			pthread_cond_broadcast (&snmp_workers_cond);
+		pthread_mutex_unlock (&snmp_workers_mutex);
+
+		for (i = 0; i < snmp_n_workers; ++i)
+			pthread_join (snmp_workers[i], NULL);
+
+		server_unwatch (snmp_decoded_signal[0]);
+		close (snmp_decoded_signal[0]);
+		close (snmp_decoded_signal[1]);
+		free (snmp_workers);
+		snmp_workers = NULL;
+		snmp_n_workers = 0;
+	}
+
+	while ((dg = snmp_decoding) != NULL) {
+		snmp_decoding = dg->next;
+		free (dg);
+	}
+
+	while ((dg = snmp_decoded) != NULL) {
+		snmp_decoded = dg->next;
+		if (dg->decoded == SNMP_CODE_OK)
+			snmp_pdu_clear (&dg->pdu);
+		free (dg);
+	}
+
+	for (i = 0; i < RECV_BATCH; ++i) {
+		free (recv_batch[i]);
+		recv_batch[i] = NULL;
+	}
+}
+
+static void
+request_send_queued (mstime when)
+{
+	struct request *req;
+	struct bucket *bucket;
+	struct host *host;
+	int sent;
+
+	/* Take turns between hosts, one packet each, while the budget allows */
+	do {
+		sent = 0;
+		for (host = host_list; host && snmp_throttled; host = host->next) {
+			if (!host->queue.first)
+				continue;
+			if (!bucket_ready (&snmp_bucket, when))
+				return;
+			bucket = host_bucket (host);
+			if (bucket && !bucket_ready (bucket, when))
+				continue;
+
+			req = host->queue.first;
+			request_unqueue (req);
+
+			/* Time spent waiting here doesn't count against the timeout */
+			req->when_timeout += when - req->queued_at;
+
+			bucket_take (&snmp_bucket);
+			if (bucket)
+				bucket_take (bucket);
+			request_send (req, when);
+			sent = 1;
+		}
+	} while (sent);
+}
+
+static void
+request_due (struct request *req, mstime when)
+{
+	if (snmp_bucket.rate || host_bucket (req->host))
+		request_queue (&req->host->queue, req, when);
+	else
+		request_send (req, when);
+}
+
+static void request_pace (mstime when);
+
+static int
+request_pace_cb (mstime when, void *arg)
+{
+	snmp_pace_pending = 0;
+	request_pace (when);
+	if (snmp_throttled)
+		request_send_queued (when);
+	return 0; /* unrepeated */
+}
+
+static void
+request_pace (mstime when)
+{
+	struct request *req;
+	mstime wait;
+
+	while (snmp_paced.first && bucket_ready (&snmp_pace, when)) {
+		bucket_take (&snmp_pace);
+
+		req = snmp_paced.first;
+		request_unqueue (req);
+
+		/* Time spent waiting here doesn't count against the timeout */
+		req->when_timeout += when - req->queued_at;
+		request_due (req, when);
+	}
+
+	/* In the percentage mode, each burst gets its own rate, and starts right away */
+	if (!snmp_paced.first) {
+		if (snmp_pace_percent) {
+			bucket_rate (&snmp_pace, 0, 0);
+			snmp_pace.tokens = BUCKET_PACKET;
+		}
+		return;
+	}
+
+	/* Come back when the next packet may go */
+	if (!snmp_pace_pending) {
+		wait = (BUCKET_PACKET - snmp_pace.tokens + snmp_pace.rate - 1) / snmp_pace.rate;
+		if (server_timer (wait ? wait : 1, request_pace_cb, NULL) == -1)
+			log_error ("couldn't setup pacing timer");
+		else
+			snmp_pace_pending = 1;
+	}
+}
+
+static void
+request_pace_add (struct request *req, mstime when)
+{
+	mstime window;
+	uint rate;
+
+	request_queue (&snmp_paced, req, when);
+
+	/*
+	 * Spread the waiting packets over a fraction of the poll interval,
+	 * the shortest interval among them decides how quickly they go.
+	 */
+	if (snmp_pace_percent) {
+		window = (req->interval * snmp_pace_percent) / 100;
+		rate = (snmp_paced.count * 1000 + window - 1) / (window ? window : 1);
+		if (rate > snmp_pace.rate)
+			bucket_rate (&snmp_pace, rate, rate < BUCKET_PACKET ? BUCKET_PACKET : rate);
+	}
 }
 
 static void
@@ -758,6 +1625,7 @@ request_process_all (mstime when)
 {
 	struct request *req;
 	hsh_index_t *i;
+	int paced = 0;
 
 	/* Go through all processing packets */
 	for (i = hsh_first (snmp_processing); i; ) {
@@ -768,20 +1636,68 @@ request_process_all (mstime when)
 		/* Move to the next, as we may delete below */
 		i = hsh_next (i);
 
-		if (when >= req->when_timeout)
+		/* Neither sent nor timed out while waiting to be sent */
+		if (req->queued)
+			continue;
+
+		if (when >= req->when_timeout) {
+			host_failed (req->host, when);
+			host_latency (req->host, when - req->prepared_at);
 			request_failure (req, -1);
-		else if (req->next_send && when >= req->next_send)
-			request_send (req, when);
+
+		} else if (req->next_send && when >= req->next_send) {
+
+			/* Only the first packet of a request is paced */
+			if (req->num_sent == 0 && (snmp_pace.rate || snmp_pace_percent)) {
+				request_pace_add (req, when);
+				paced = 1;
+			} else {
+				request_due (req, when);
+			}
+		}
 	}
+
+	if (paced)
+		request_pace (when);
+	if (snmp_throttled)
+		request_send_queued (when);
 }
 
+/*
+ * The resend timer runs every 1/5 second, which is often enough for the
+ * retries of most polls. Sub-second polls replace it with a quicker one.
+ */
+
+#define RESEND_PERIOD     200
+#define RESEND_MINIMUM    10
+
+static mstime snmp_resend_period = RESEND_PERIOD;
+
 static int
 request_resend_timer (mstime when, void* arg)
 {
+	/* Replaced by a quicker one, see below */
+	if ((mstime)(size_t)arg != snmp_resend_period)
+		return 0;
+
 	request_process_all (when);
 	return 1;
 }
 
+static void
+request_resend_period (mstime period)
+{
+	if (period >= snmp_resend_period)
+		return;
+
+	if (server_timer (period, request_resend_timer, (void*)(size_t)period) == -1) {
+		log_errorx ("couldn't setup resend timer");
+		return;
+	}
+
+	snmp_resend_period = period;
+}
+
 static void
 request_flush (struct request *req, mstime when)
 {
@@ -792,195 +1708,669 @@ request_flush (struct request *req, mstime when)
 	val = hsh_rem (snmp_preparing, &req->snmp_id, sizeof (req->snmp_id));
 	ASSERT (val == req);
 
-	/* Don't let us add more onto this request via the host */
-	ASSERT (req->host->prepared == req);
-	req->host->prepared = NULL;
+	/* Don't let us add more onto this request via the host */
+	ASSERT (req->host->prepared == req);
+	req->host->prepared = NULL;
+
+	/* Mark this packet to be sent now */
+	req->next_send = when;
+
+	if (!hsh_set (snmp_processing, &req->snmp_id, sizeof (req->snmp_id), req)) {
+		log_errorx ("out of memory, discarding packets");
+		request_release (req);
+	}
+}
+
+static void
+request_flush_all (mstime when)
+{
+	struct request *req;
+	hsh_index_t *i;
+
+	/* Transfer everything to the processing table */
+	for (i = hsh_first (snmp_preparing); i; ) {
+		req = hsh_this (i, NULL, NULL);
+
+		/* Do this here, because below removes from table */
+		i = hsh_next (i);
+
+		request_flush (req, when);
+	}
+
+	/* Clear the preparing table */
+	hsh_clear (snmp_preparing);
+
+	/* Process all packets in processing */
+	request_process_all (when);
+}
+
+/* Forward declaration */
+static int request_flush_cb (mstime when, void *arg);
+
+static void
+request_flush_due (mstime when)
+{
+	struct request *req;
+	hsh_index_t *i;
+	mstime due, wait = 0;
+
+	/* Only those that have been open for the whole window */
+	for (i = hsh_first (snmp_preparing); i; ) {
+		req = hsh_this (i, NULL, NULL);
+
+		/* Do this here, because below removes from table */
+		i = hsh_next (i);
+
+		due = req->prepared_at + snmp_coalesce;
+		if (due <= when)
+			request_flush (req, when);
+		else if (!wait || due - when < wait)
+			wait = due - when;
+	}
+
+	/* Process all packets in processing */
+	request_process_all (when);
+
+	/* And come back when the next window is up */
+	if (wait && !snmp_flush_pending) {
+		server_timer (wait, request_flush_cb, NULL);
+		snmp_flush_pending = 1;
+	}
+}
+
+static int
+request_flush_cb (mstime when, void *arg)
+{
+	snmp_flush_pending = 0;
+	if (snmp_coalesce)
+		request_flush_due (when);
+	else
+		request_flush_all (when);
+	return 0; // unrepeated
+}
+
+static mstime
+request_retry_interval (mstime interval)
+{
+	/* A quarter of the interval when that's below one second */
+	if (interval < 1000)
+		return interval / 4 < RESEND_MINIMUM ? RESEND_MINIMUM : interval / 4;
+
+	/* Send interval is 200 ms when poll interval is below 2 seconds */
+	return (interval <= 2000) ? 200L : 600L;
+}
+
+/* How long after being prepared a request is given up on */
+uint64_t
+snmp_engine_lifetime (uint64_t interval, uint64_t timeout)
+{
+	/* Timeout is for the last packet sent, not first */
+	return (request_retry_interval (interval) * ((mstime)snmp_retries)) +
+	       timeout + snmp_coalesce;
+}
+
+static struct request*
+request_prep_instance (struct host *host, mstime interval, mstime timeout, int reqtype)
+{
+	struct request *req;
+
+	/* See if we have one we can piggy back onto */
+	req = host->prepared;
+	if (req) {
+		ASSERT (hsh_get (snmp_preparing, &req->snmp_id, sizeof (req->snmp_id)));
+
+		/* We have one we can piggy back another request onto */
+		if (req->pdu.nbindings < SNMP_MAX_BINDINGS && req->pdu.type == reqtype)
+			return req;
+
+		/* It's too full, so send it off */
+		request_flush (req, server_get_time ());
+		req = NULL;
+	}
+
+	ASSERT (host->prepared == NULL);
+
+	/* Create a new request */
+	req = calloc (1, sizeof (struct request));
+	if (!req) {
+		log_error ("out of memory");
+		return NULL;
+	}
+
+	/* Assign the unique id */
+	req->snmp_id = snmp_request_id;
+	++snmp_request_id;
+
+	/*
+	 * Roll around after a decent amount of ids. Since we're using
+	 * signed integers, and these are used in strange ways, we can't
+	 * go above 0x800000 or so.
+	 */
+	if (snmp_request_id > MAX_SNMP_REQUEST_ID)
+		snmp_request_id = 1;
+
+	/* Mark it down as something we want to prepare */
+	if (!hsh_set (snmp_preparing, &req->snmp_id, sizeof (req->snmp_id), req)) {
+		log_error ("out of memory");
+		free (req);
+		return NULL;
+	}
+
+	/* Setup the packet */
+	strlcpy (req->pdu.community, host->community, sizeof (req->pdu.community));
+	req->pdu.request_id = req->snmp_id;
+	req->pdu.version = host->version;
+	req->pdu.type = reqtype;
+	req->pdu.error_status = 0;
+	req->pdu.error_index = 0;
+	req->pdu.nbindings = 0;
+
+	/* No non-repeaters, and as many repetitions as we can decode */
+	if (reqtype == SNMP_PDU_GETBULK)
+		req->pdu.error_index = SNMP_MAX_BINDINGS;
+
+	req->interval = interval;
+	req->prepared_at = server_get_time ();
+
+	req->retry_interval = request_retry_interval (interval);
+	if (interval < 1000)
+		request_resend_period (req->retry_interval);
+
+	req->when_timeout = server_get_time () + snmp_engine_lifetime (interval, timeout);
+	req->num_sent = 0;
+
+	/* Add it to the host */
+	req->host = host;
+	ASSERT (host->prepared == NULL);
+	host->prepared = req;
+
+	log_debug ("preparing request #%d for: %s@%s", req->snmp_id,
+	           req->host->community, req->host->hostname);
+
+	return req;
+}
+
+snmp_host*
+snmp_engine_host (const char *hostname, const char *port,
+                  const char *community, int version, mstime interval)
+{
+	return host_instance (hostname, port, community, version, interval);
+}
+
+void
+snmp_engine_address (const char *hostname, const char *address)
+{
+	char *key, *old;
+	size_t len;
+
+	ASSERT (hostname);
+	ASSERT (address);
+
+	/* The key and the address in one block */
+	len = strlen (hostname) + 1;
+	key = malloc (len + strlen (address) + 1);
+	if (!key) {
+		log_errorx ("out of memory");
+		return;
+	}
+
+	memcpy (key, hostname, len);
+	strcpy (key + len, address);
+
+	/* The address follows the key of any previous one */
+	old = hsh_rem (host_remembered, hostname, -1);
+	if (old)
+		free (old - len);
+
+	if (!hsh_set (host_remembered, key, -1, key + len)) {
+		log_errorx ("out of memory");
+		free (key);
+	}
+}
+
+void
+snmp_engine_addresses (snmp_address_func func, void *data)
+{
+	char address[NI_MAXHOST];
+	struct host *host;
+	hsh_t *done;
+
+	ASSERT (func);
+
+	/* Host names can be in several hosts */
+	done = hsh_create ();
+	if (!done) {
+		log_errorx ("out of memory");
+		return;
+	}
+
+	/* Only those that we had to look up */
+	for (host = host_list; host; host = host->next) {
+		if (!host->must_resolve || !host->is_resolved)
+			continue;
+		if (hsh_get (done, host->hostname, -1))
+			continue;
+		if (getnameinfo ((struct sockaddr*)&host->address, host->address_len,
+		                 address, sizeof (address), NULL, 0, NI_NUMERICHOST) != 0)
+			continue;
+		if (!hsh_set (done, host->hostname, -1, host))
+			break;
+		(func) (host->hostname, address, data);
+	}
+
+	hsh_free (done);
+}
+
+void
+snmp_engine_latency (const char *hostname, uint64_t latency, uint64_t at)
+{
+	struct remembered_latency *rl;
+
+	ASSERT (hostname);
+
+	rl = malloc (sizeof (struct remembered_latency) + strlen (hostname));
+	if (!rl) {
+		log_errorx ("out of memory");
+		return;
+	}
+
+	rl->latency = latency;
+	rl->at = at;
+	strcpy (rl->hostname, hostname);
+
+	free (hsh_rem (latency_remembered, hostname, -1));
+	if (!hsh_set (latency_remembered, rl->hostname, -1, rl)) {
+		log_errorx ("out of memory");
+		free (rl);
+	}
+}
+
+void
+snmp_engine_latencies (snmp_latency_func func, void *data)
+{
+	struct host *host;
+	hsh_t *done;
+
+	ASSERT (func);
+
+	/* Host names can be in several hosts */
+	done = hsh_create ();
+	if (!done) {
+		log_errorx ("out of memory");
+		return;
+	}
+
+	for (host = host_list; host; host = host->next) {
+		if (!host->latency_at)
+			continue;
+		if (hsh_get (done, host->hostname, -1))
+			continue;
+		if (!hsh_set (done, host->hostname, -1, host))
+			break;
+		(func) (host->hostname, host->latency, host->latency_at, data);
+	}
+
+	hsh_free (done);
+}
+
+void
+snmp_engine_throttle (struct host *host, uint rate)
+{
+	/* Hosts can be shared by pollers, the lowest rate wins */
+	if (host) {
+		if (rate && (!host->throttle || rate < host->throttle)) {
+			host->throttle = rate;
+			log_debug ("will send at most %u packets per second to: %s",
+			           rate, host->hostname);
+		}
+
+	/* Allow a burst of up to one second of packets */
+	} else if (rate && (!snmp_bucket.rate || rate < snmp_bucket.rate)) {
+		bucket_rate (&snmp_bucket, rate, rate * BUCKET_PACKET);
+	}
+}
+
+void
+snmp_engine_workers (int count)
+{
+	int i;
+
+	ASSERT (!snmp_n_workers);
+	if (count <= 0)
+		return;
+
+	if (pipe (snmp_decoded_signal) == -1)
+		err (1, "couldn't create pipe");
+	for (i = 0; i < 2; ++i)
+		fcntl (snmp_decoded_signal[i], F_SETFL,
+		       fcntl (snmp_decoded_signal[i], F_GETFL, 0) | O_NONBLOCK);
+	if (server_watch (snmp_decoded_signal[0], SERVER_READ, datagram_decoded, NULL) == -1)
+		err (1, "couldn't watch pipe");
+
+	snmp_workers = xcalloc (sizeof (pthread_t) * count);
+	for (i = 0; i < count; ++i) {
+		if (pthread_create (&snmp_workers[i], NULL, datagram_worker, NULL) != 0)
+			errx (1, "couldn't start worker thread");
+		++snmp_n_workers;
+	}
+
+	log_debug ("decoding snmp packets on %d worker threads", count);
+}
+
+void
+snmp_engine_breaker (uint polls)
+{
+	snmp_breaker = polls;
+}
+
+int
+snmp_engine_host_down (struct host *host)
+{
+	return host && host->is_down;
+}
+
+void
+snmp_engine_coalesce (uint window)
+{
+	snmp_coalesce = window;
+	if (window)
+		log_debug ("packets stay open to more bindings for %u ms", window);
+}
+
+void
+snmp_engine_pace (uint rate, uint percent)
+{
+	ASSERT (percent <= 100);
+
+	/* No bursts at all, beyond what comes in a millisecond */
+	if (rate)
+		bucket_rate (&snmp_pace, rate, rate < BUCKET_PACKET ? BUCKET_PACKET : rate);
+	snmp_pace_percent = percent;
+}
+
+int
+snmp_engine_request (const char *hostname, const char *port,
+                     const char *community, int version,
+                     mstime interval, mstime timeout, int reqtype,
+                     struct asn_oid *oid, snmp_response func, void *arg)
+{
+	struct host *host;
+
+	/* Lookup host for request */
+	host = host_instance (hostname, port, community, version, interval);
+	if (!host)
+		return 0;
+
+	return snmp_engine_host_request (host, interval, timeout, reqtype, oid, func, arg);
+}
+
+static int
+request_binding (struct host *host, mstime interval, mstime timeout, int reqtype,
+                 struct asn_oid *oid, snmp_response func, snmp_batch_response batch,
+                 void *cookie, void *arg)
+{
+	struct request *req;
+	int is_duplicate;
+	int callback_id;
+
+	ASSERT (host);
+	ASSERT (func || batch);
+
+	/* Hosts that are down only get their probe */
+	if (host->is_down && !snmp_probing) {
+		log_debug ("skipping request for: %s@%s: host is down",
+		           host->community, host->hostname);
+		return 0;
+	}
+
+	/*
+	 * When the same GET is already being prepared or waiting for a response,
+	 * whether from this poller or another one, we piggy back onto that one.
+	 * The response is then dispatched to every callback for that OID, and
+	 * this callback shares that request's timeout.
+	 */
+	req = NULL;
+	if (reqtype == SNMP_PDU_GET) {
+		req = hsh_get (host->inflight, OID_KEY (oid));
+		if (req && req->pdu.nbindings >= SNMP_MAX_BINDINGS)
+			req = NULL;
+	}
+
+	is_duplicate = (req != NULL);
+	if (is_duplicate) {
+		log_debug ("sharing request #%d for: %s@%s", req->snmp_id,
+		           req->host->community, req->host->hostname);
+
+	/* Get a request with space or a new request for that host */
+	} else {
+		req = request_prep_instance (host, interval, timeout, reqtype);
+		if (!req)
+			return 0;
+	}
+
+	ASSERT (req->pdu.nbindings < SNMP_MAX_BINDINGS);
+
+	/* Add the oid to that request */
+	callback_id = req->pdu.nbindings;
+	if (is_duplicate) {
+		req->position[callback_id] = request_position (req, oid);
+		++req->duplicates;
+	} else {
+		req->position[callback_id] = callback_id - req->duplicates;
+	}
+	req->pdu.bindings[callback_id].var = *oid;
+	req->pdu.bindings[callback_id].syntax = SNMP_SYNTAX_NULL;
+	req->callbacks[callback_id].func = func;
+	req->callbacks[callback_id].batch = batch;
+	req->callbacks[callback_id].arg = arg;
+	req->callbacks[callback_id].cookie = cookie;
+	req->is_duplicate[callback_id] = is_duplicate;
+	req->pdu.nbindings++;
+
+	if (reqtype == SNMP_PDU_GET && !is_duplicate)
+		request_inflight_add (req, callback_id);
+
+	/* Shared requests are already on their way */
+	if (is_duplicate)
+		return MAKE_REQUEST_ID (req->snmp_id, callback_id);
 
-	/* Mark this packet to be sent now */
-	req->next_send = when;
+	/* All other than GET, only get one binding */
+	if (reqtype != SNMP_PDU_GET) {
+		ASSERT (req->pdu.nbindings == 1);
+		request_flush (req, server_get_time ());
+	}
 
-	if (!hsh_set (snmp_processing, &req->snmp_id, sizeof (req->snmp_id), req)) {
-		log_errorx ("out of memory, discarding packets");
-		request_release (req);
+	/* And go out on the idle callback, or after the coalescing window */
+	if (!snmp_flush_pending) {
+		server_timer (snmp_coalesce, request_flush_cb, NULL);
+		snmp_flush_pending = 1;
 	}
+
+	return MAKE_REQUEST_ID (req->snmp_id, callback_id);
 }
 
+/* ------------------------------------------------------------------------------
+ * RESPONSE TIMES
+ */
+
+/*
+ * Each host keeps a smoothed response time, where requests that get no
+ * response count as taking as long as they were waited for. This is
+ * used to choose between alternate hosts. When a host goes unused the
+ * time is halved every so often, so that slow or failed hosts are
+ * eventually tried again.
+ */
+
+#define LATENCY_WEIGHT    8               /* Each sample is 1/8th of the average */
+#define LATENCY_FORGIVE   (5 * 60 * 1000) /* Halved after this long unused */
+
 static void
-request_flush_all (mstime when)
+host_latency (struct host *host, mstime latency)
 {
-	struct request *req;
-	hsh_index_t *i;
-
-	/* Transfer everything to the processing table */
-	for (i = hsh_first (snmp_preparing); i; ) {
-		req = hsh_this (i, NULL, NULL);
+	/* The first sample is taken as is */
+	if (!host->latency_at)
+		host->latency = latency;
+	else
+		host->latency = (host->latency * (LATENCY_WEIGHT - 1) + latency) /
+		                LATENCY_WEIGHT;
 
-		/* Do this here, because below removes from table */
-		i = hsh_next (i);
+	host->latency_at = server_get_time ();
+}
 
-		request_flush (req, when);
-	}
+uint64_t
+snmp_engine_host_latency (struct host *host)
+{
+	mstime unused;
 
-	/* Clear the preparing table */
-	hsh_clear (snmp_preparing);
+	if (!host || !host->latency_at)
+		return 0;
 
-	/* Process all packets in processing */
-	request_process_all (when);
+	unused = (server_get_time () - host->latency_at) / LATENCY_FORGIVE;
+	if (unused >= 64)
+		return 0;
+	return host->latency >> unused;
 }
 
+/* ------------------------------------------------------------------------------
+ * CIRCUIT BREAKER
+ */
+
+/*
+ * When a host hasn't responded for a number of polls in a row, it's
+ * marked down. Requests for it then fail right away without being sent.
+ * Instead a cheap probe is sent, at first once per poll interval, and
+ * then twice as long between each. Any response puts the host back up.
+ */
+
+/* sysUpTime.0, which all agents have */
+static struct asn_oid host_probe_oid = { 9, { 1, 3, 6, 1, 2, 1, 1, 3, 0 } };
 
+/* The longest time between probes, as a multiple of the poll interval */
+#define PROBE_BACKOFF_MAX 64
 
-static int
-request_flush_cb (mstime when, void *arg)
+static void
+host_alive (struct host *host)
 {
-	snmp_flush_pending = 0;
-	request_flush_all (when);
-	return 0; // unrepeated
+	host->responded_at = server_get_time ();
+	host->failed_polls = 0;
+	if (!host->is_down)
+		return;
+
+	log_info ("host is responding again: %s", host->hostname);
+	host->is_down = 0;
 }
 
-static struct request*
-request_prep_instance (struct host *host, mstime interval, mstime timeout,
-                       int reqtype, struct asn_oid *oid, int *is_duplicate)
+static void
+host_failed (struct host *host, mstime when)
 {
-	struct request *req;
-	struct snmp_value *rvalue;
-	int i;
+	if (!snmp_breaker || host->is_down)
+		return;
 
-	*is_duplicate = 0;
+	/* Only one failure is counted for each poll */
+	if (host->failed_polls && when - host->failed_at < host->interval)
+		return;
 
-	/* See if we have one we can piggy back onto */
-	req = host->prepared;
-	if (req) {
-		ASSERT (hsh_get (snmp_preparing, &req->snmp_id, sizeof (req->snmp_id)));
+	host->failed_at = when;
+	if (++host->failed_polls < snmp_breaker)
+		return;
 
-		if (req->pdu.type == SNMP_PDU_GET) {
-			/*
-			 * Check whether oid is already waiting in the pdu so we can avoid
-			 * asking for it twice in the same request - we know request_get_dispatch
-			 * will find the first copy for each callback anyway
-			 */
-			for (i = 0; i < req->pdu.nbindings; ++i) {
-				rvalue = &(req->pdu.bindings[i]);
-				if (asn_compare_oid (&(rvalue->var), oid) == 0) {
-					*is_duplicate = 1;
-					return req;
-				}
-			}
-		}
+	log_info ("host is not responding, only probing: %s", host->hostname);
+	host->is_down = 1;
+	host->probe_backoff = host->interval;
+	host->probe_at = when + host->probe_backoff;
+}
 
-		/* We have one we can piggy back another request onto */
-		if (req->pdu.nbindings < SNMP_MAX_BINDINGS && req->pdu.type == reqtype)
-			return req;
+static void
+host_probe_response (int request, int code, struct snmp_value *value, void *arg)
+{
+	struct host *host = arg;
 
-		/* It's too full, so send it off */
-		request_flush (req, server_get_time ());
-		req = NULL;
-	}
+	host->is_probing = 0;
 
-	ASSERT (host->prepared == NULL);
+	/* A response was already noted by host_alive() */
+	if (!host->is_down)
+		return;
 
-	/* Create a new request */
-	req = calloc (1, sizeof (struct request));
-	if (!req) {
-		log_error ("out of memory");
-		return NULL;
-	}
+	if (host->probe_backoff < host->interval * PROBE_BACKOFF_MAX)
+		host->probe_backoff *= 2;
+	host->probe_at = server_get_time () + host->probe_backoff;
 
-	/* Assign the unique id */
-	req->snmp_id = snmp_request_id;
-	++snmp_request_id;
+	log_debug ("host still not responding, next probe in %d seconds: %s",
+	           (int)(host->probe_backoff / 1000), host->hostname);
+}
 
-	/*
-	 * Roll around after a decent amount of ids. Since we're using
-	 * signed integers, and these are used in strange ways, we can't
-	 * go above 0x800000 or so.
-	 */
-	if (snmp_request_id > MAX_SNMP_REQUEST_ID)
-		snmp_request_id = 1;
+static void
+host_probe (struct host *host, mstime when)
+{
+	int req;
 
-	/* Mark it down as something we want to prepare */
-	if (!hsh_set (snmp_preparing, &req->snmp_id, sizeof (req->snmp_id), req)) {
-		log_error ("out of memory");
-		free (req);
-		return NULL;
-	}
+	log_debug ("probing host that is down: %s", host->hostname);
 
-	/* Setup the packet */
-	strlcpy (req->pdu.community, host->community, sizeof (req->pdu.community));
-	req->pdu.request_id = req->snmp_id;
-	req->pdu.version = host->version;
-	req->pdu.type = reqtype;
-	req->pdu.error_status = 0;
-	req->pdu.error_index = 0;
-	req->pdu.nbindings = 0;
+	snmp_probing = 1;
+	req = request_binding (host, host->interval, host->interval, SNMP_PDU_GET,
+	                       &host_probe_oid, host_probe_response, NULL, NULL, host);
+	snmp_probing = 0;
 
-	/* Send interval is 200 ms when poll interval is below 2 seconds */
-	req->retry_interval = (interval <= 2000) ? 200L : 600L;
+	if (req)
+		host->is_probing = 1;
+	else
+		host->probe_at = when + host->probe_backoff;
+}
 
-	/* Timeout is for the last packet sent, not first */
-	req->when_timeout = server_get_time () + (req->retry_interval * ((mstime)snmp_retries)) + timeout;
-	req->num_sent = 0;
+static int
+host_probe_timer (mstime when, void *arg)
+{
+	struct host *h;
 
-	/* Add it to the host */
-	req->host = host;
-	ASSERT (host->prepared == NULL);
-	host->prepared = req;
+	if (!snmp_breaker)
+		return 1;
 
-	log_debug ("preparing request #%d for: %s@%s", req->snmp_id,
-	           req->host->community, req->host->hostname);
+	for (h = host_list; h; h = h->next) {
+		if (h->is_down && !h->is_probing && when >= h->probe_at)
+			host_probe (h, when);
+	}
 
-	return req;
+	return 1;
 }
 
 int
-snmp_engine_request (const char *hostname, const char *port,
-                     const char *community, int version,
-                     mstime interval, mstime timeout, int reqtype,
-                     struct asn_oid *oid, snmp_response func, void *arg)
+snmp_engine_host_request (struct host *host, mstime interval, mstime timeout,
+                          int reqtype, struct asn_oid *oid, snmp_response func, void *arg)
 {
-	struct host *host;
-	struct request *req;
-	int is_duplicate;
-	int callback_id;
-
 	ASSERT (func);
 
-	/* Lookup host for request */
-	host = host_instance (hostname, port, community, version, interval);
+	/* The host couldn't be looked up when the handle was made */
 	if (!host)
 		return 0;
 
-	/* Get a request with space or a new request for that host */
-	req = request_prep_instance (host, interval, timeout, reqtype, oid, &is_duplicate);
-	if (!req)
-		return 0;
-
-	if (is_duplicate)
-		++req->duplicates;
-	ASSERT (req->pdu.nbindings - req->duplicates < SNMP_MAX_BINDINGS);
+	return request_binding (host, interval, timeout, reqtype, oid, func, NULL, NULL, arg);
+}
 
-	/* Add the oid to that request */
-	callback_id = req->pdu.nbindings;
-	req->pdu.bindings[callback_id].var = *oid;
-	req->pdu.bindings[callback_id].syntax = SNMP_SYNTAX_NULL;
-	req->callbacks[callback_id].func = func;
-	req->callbacks[callback_id].arg = arg;
-	req->is_duplicate[callback_id] = is_duplicate;
-	req->pdu.nbindings++;
+int
+snmp_engine_batch (struct host *host, mstime interval, mstime timeout,
+                   struct snmp_batch *batch, int count, snmp_batch_response func, void *arg)
+{
+	int i, n;
 
-	/* All other than GET, only get one binding */
-	if (reqtype != SNMP_PDU_GET) {
-		ASSERT (req->pdu.nbindings == 1);
-		request_flush (req, server_get_time ());
-	}
+	ASSERT (func);
+	ASSERT (batch || !count);
 
-	/* Otherwise flush on the idle callback */
-	else if (!snmp_flush_pending) {
-		server_timer (0, request_flush_cb, NULL);
-		snmp_flush_pending = 1;
+	/*
+	 * Each binding goes in like any other GET, filling up the prepared
+	 * requests for the host. The callback is called once per response
+	 * packet, with all the bindings of this batch it contains.
+	 */
+	for (i = 0, n = 0; i < count; ++i) {
+		batch[i].value = NULL;
+		batch[i].request = 0;
+		if (host)
+			batch[i].request = request_binding (host, interval, timeout, SNMP_PDU_GET,
+			                                    batch[i].oid, NULL, func, batch[i].cookie, arg);
+		if (batch[i].request)
+			++n;
 	}
 
-	return MAKE_REQUEST_ID (req->snmp_id, callback_id);
+	return n;
 }
 
 void
@@ -1006,19 +2396,31 @@ snmp_engine_remove (int id, const char *during)
 	if (!req)
 		return;
 
+	/* Already called back, or removed */
+	if (!CALLBACK_ACTIVE (req, callback_id))
+		return;
+
 	/* Remove this callback from the request */
 	req->callbacks[callback_id].func = NULL;
+	req->callbacks[callback_id].batch = NULL;
 	req->callbacks[callback_id].arg = NULL;
+	req->callbacks[callback_id].cookie = NULL;
 
 	/* See if any other callbacks exist in the request */
 	for (i = 0; i < req->pdu.nbindings; ++i) {
-		if (req->callbacks[i].func)
+		if (CALLBACK_ACTIVE (req, i))
 			return;
 	}
 
 	if (during)
 		log_debug ("cancelling request #%d during %s", snmp_id, during);
 
+	/* Given up on without any response from the host, much like a timeout */
+	if (req->num_sent && req->host->responded_at < req->prepared_at) {
+		host_failed (req->host, server_get_time ());
+		host_latency (req->host, server_get_time () - req->prepared_at);
+	}
+
 	hsh_rem (snmp_processing, &snmp_id, sizeof (snmp_id));
 	hsh_rem (snmp_preparing, &snmp_id, sizeof (snmp_id));
 
@@ -1071,7 +2473,197 @@ snmp_engine_cancel (int id)
 void
 snmp_engine_flush (void)
 {
-	request_flush_all (server_get_time ());
+	/* Others may still add to packets in their window */
+	if (snmp_coalesce)
+		request_flush_due (server_get_time ());
+	else
+		request_flush_all (server_get_time ());
+}
+
+/* -------------------------------------------------------------------------------
+ * WALKS
+ */
+
+struct walk {
+	int id;                   /* The walk identifier */
+	struct host *host;        /* Host being walked */
+	mstime interval;          /* Passed to each request */
+	mstime timeout;
+	struct asn_oid root;      /* Only OIDs under this one */
+	struct asn_oid last;      /* The last OID we got back */
+	int request;              /* The request in progress */
+	snmp_walk_response func;
+	void *arg;
+};
+
+/* The next walk id */
+static int snmp_walk_id = 1;
+
+/* Hash table of all walks, by id */
+static hsh_t *snmp_walking = NULL;
+
+static void
+walk_complete (struct walk *walk, int code)
+{
+	/* Cancelling from the callback does nothing */
+	ASSERT (hsh_get (snmp_walking, &walk->id, sizeof (walk->id)) == walk);
+	hsh_rem (snmp_walking, &walk->id, sizeof (walk->id));
+
+	log_debug ("walk #%d is complete", walk->id);
+
+	(walk->func) (walk->id, code, NULL, 0, walk->arg);
+	free (walk);
+}
+
+static void
+walk_next (struct walk *walk)
+{
+	int reqtype;
+
+	/* There's no GETBULK in SNMPv1 */
+	reqtype = (walk->host->version == SNMP_V1) ? SNMP_PDU_GETNEXT : SNMP_PDU_GETBULK;
+
+	walk->request = request_binding (walk->host, walk->interval, walk->timeout, reqtype,
+	                                 &walk->last, walk_response, NULL, NULL, walk);
+	if (!walk->request)
+		walk_complete (walk, -1);
+}
+
+static void
+walk_response (int request, int code, struct snmp_value *value, void *arg)
+{
+	struct walk *walk = arg;
+
+	/* Values come through walk_dispatch, this is a failure */
+	ASSERT (code != SNMP_ERR_NOERROR);
+	ASSERT (walk->request == request);
+	walk->request = 0;
+
+	/* SNMPv1 agents answer like this at the end of the MIB */
+	if (code == SNMP_ERR_NOSUCHNAME)
+		code = SNMP_ERR_NOERROR;
+
+	walk_complete (walk, code);
+}
+
+static void
+walk_dispatch (void *arg, struct snmp_pdu *pdu)
+{
+	struct walk *walk = arg;
+	struct snmp_value *value;
+	int id, n, done;
+
+	walk->request = 0;
+
+	/*
+	 * Take values in order while they're still under the root, and
+	 * moving forward, so a broken agent can't walk us in circles.
+	 */
+	for (n = 0, done = 0; !done && n < pdu->nbindings; ++n) {
+		value = &(pdu->bindings[n]);
+		switch (value->syntax) {
+		case SNMP_SYNTAX_NOSUCHOBJECT:
+		case SNMP_SYNTAX_NOSUCHINSTANCE:
+		case SNMP_SYNTAX_ENDOFMIBVIEW:
+			done = 1;
+			break;
+		default:
+			if (!asn_is_suboid (&walk->root, &value->var) ||
+			    asn_compare_oid (&value->var, &walk->last) <= 0)
+				done = 1;
+			else
+				walk->last = value->var;
+			break;
+		};
+	}
+
+	if (done)
+		--n;
+	else if (n == 0)
+		done = 1;
+
+	if (n > 0) {
+		id = walk->id;
+		(walk->func) (id, SNMP_ERR_NOERROR, pdu->bindings, n, walk->arg);
+
+		/* Walk could have been cancelled by the callback */
+		if (hsh_get (snmp_walking, &id, sizeof (id)) != walk)
+			return;
+	}
+
+	if (done)
+		walk_complete (walk, SNMP_ERR_NOERROR);
+	else
+		walk_next (walk);
+}
+
+int
+snmp_engine_walk (struct host *host, mstime interval, mstime timeout,
+                  struct asn_oid *oid, snmp_walk_response func, void *arg)
+{
+	struct walk *walk;
+
+	ASSERT (oid);
+	ASSERT (func);
+
+	/* The host couldn't be looked up when the handle was made */
+	if (!host)
+		return 0;
+
+	walk = calloc (1, sizeof (struct walk));
+	if (!walk) {
+		log_errorx ("out of memory");
+		return 0;
+	}
+
+	walk->id = snmp_walk_id++;
+	if (snmp_walk_id >= INT_MAX)
+		snmp_walk_id = 1;
+
+	walk->host = host;
+	walk->interval = interval;
+	walk->timeout = timeout;
+	walk->root = *oid;
+	walk->last = *oid;
+	walk->func = func;
+	walk->arg = arg;
+
+	if (!hsh_set (snmp_walking, &walk->id, sizeof (walk->id), walk)) {
+		log_errorx ("out of memory");
+		free (walk);
+		return 0;
+	}
+
+	log_debug ("walking #%d: %s@%s", walk->id, host->community, host->hostname);
+
+	walk->request = request_binding (host, interval, timeout,
+	                                 (host->version == SNMP_V1) ? SNMP_PDU_GETNEXT : SNMP_PDU_GETBULK,
+	                                 &walk->last, walk_response, NULL, NULL, walk);
+	if (!walk->request) {
+		hsh_rem (snmp_walking, &walk->id, sizeof (walk->id));
+		free (walk);
+		return 0;
+	}
+
+	return walk->id;
+}
+
+void
+snmp_engine_walk_cancel (int id)
+{
+	struct walk *walk;
+
+	ASSERT (id);
+
+	walk = hsh_rem (snmp_walking, &id, sizeof (id));
+	if (!walk)
+		return;
+
+	log_debug ("cancelling walk #%d", id);
+
+	if (walk->request)
+		snmp_engine_cancel (walk->request);
+	free (walk);
 }
 
 /* -------------------------------------------------------------------------------
@@ -1151,6 +2743,10 @@ snmp_engine_init (const char **bindaddrs, int retries)
 	if (!snmp_preparing)
 		err (1, "out of memory");
 
+	snmp_walking = hsh_create ();
+	if (!snmp_walking)
+		err (1, "out of memory");
+
 	ASSERT (snmp_sockets == NULL);
 
 	for (p = bindaddrs; p && *p; ++p) {
@@ -1203,7 +2799,8 @@ snmp_engine_init (const char **bindaddrs, int retries)
 		errx (1, "no local addresses to listen on");
 
 	/* We fire off the resend timer every 1/5 second */
-	if (server_timer (200, request_resend_timer, NULL) == -1)
+	snmp_resend_period = RESEND_PERIOD;
+	if (server_timer (RESEND_PERIOD, request_resend_timer, (void*)(size_t)RESEND_PERIOD) == -1)
 	    err(1, "couldn't setup timer");
 
 	host_initialize ();
@@ -1213,6 +2810,7 @@ void
 snmp_engine_stop (void)
 {
 	struct socket *sock;
+	hsh_index_t *i;
 
 	while (snmp_sockets != NULL) {
 		/* Pop off the list */
@@ -1234,6 +2832,14 @@ snmp_engine_stop (void)
 	if (snmp_processing)
 		request_release_all (snmp_processing);
 
+	/* Walks no longer have requests */
+	if (snmp_walking) {
+		for (i = hsh_first (snmp_walking); i; i = hsh_next (i))
+			free (hsh_this (i, NULL, NULL));
+		hsh_free (snmp_walking);
+	}
+	snmp_walking = NULL;
+
 	/* Now we can safely free both hashes. */
 	if (snmp_preparing)
 		hsh_free (snmp_preparing);
@@ -1244,6 +2850,7 @@ snmp_engine_stop (void)
 	snmp_processing = NULL;
 
 	host_cleanup ();
+	datagram_cleanup ();
 }
 
 int
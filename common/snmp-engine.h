@@ -6,14 +6,74 @@
 
 typedef void (*snmp_response) (int request, int code, struct snmp_value *value, void *data);
 
+/* A handle to an agent, valid until snmp_engine_stop() */
+typedef struct host snmp_host;
+
+/* One binding of a batch, see snmp_engine_batch() */
+struct snmp_batch {
+	struct asn_oid *oid;            /* The OID to GET */
+	void *cookie;                   /* Handed back with the value */
+	int request;                    /* Request id for this binding, or zero */
+	struct snmp_value *value;       /* In responses, the value or NULL */
+};
+
+typedef void (*snmp_batch_response) (int code, struct snmp_batch *batch, int count, void *data);
+
+/* Called with each lot of values found, and then once with none at the end */
+typedef void (*snmp_walk_response) (int walk, int code, struct snmp_value *values, int count, void *data);
+
+/* Called with the numeric address of each host name that was resolved */
+typedef void (*snmp_address_func) (const char *hostname, const char *address, void *data);
+
+/* Called with the smoothed response time of each host name, and when it was last noted */
+typedef void (*snmp_latency_func) (const char *hostname, uint64_t latency, uint64_t at, void *data);
+
 void snmp_engine_init (const char **bind_addresses, int retries);
 
+snmp_host* snmp_engine_host (const char* host, const char *port, const char* community,
+                             int version, uint64_t interval);
+
+void snmp_engine_address (const char *hostname, const char *address);
+
+void snmp_engine_addresses (snmp_address_func func, void *data);
+
+void snmp_engine_latency (const char *hostname, uint64_t latency, uint64_t at);
+
+void snmp_engine_latencies (snmp_latency_func func, void *data);
+
+void snmp_engine_throttle (snmp_host *host, unsigned int rate);
+
+void snmp_engine_pace (unsigned int rate, unsigned int percent);
+
+void snmp_engine_coalesce (unsigned int window);
+
+void snmp_engine_workers (int count);
+
+void snmp_engine_breaker (unsigned int polls);
+
+int  snmp_engine_host_down (snmp_host *host);
+
+uint64_t snmp_engine_host_latency (snmp_host *host);
+
+uint64_t snmp_engine_lifetime (uint64_t interval, uint64_t timeout);
+
 int  snmp_engine_request (const char* host, const char *port, const char* community,
                           int version, uint64_t interval, uint64_t timeout, int reqtype,
                           struct asn_oid *oid, snmp_response func, void *data);
 
+int  snmp_engine_host_request (snmp_host *host, uint64_t interval, uint64_t timeout,
+                               int reqtype, struct asn_oid *oid, snmp_response func, void *data);
+
+int  snmp_engine_batch (snmp_host *host, uint64_t interval, uint64_t timeout,
+                        struct snmp_batch *batch, int count, snmp_batch_response func, void *data);
+
 void snmp_engine_cancel (int reqid);
 
+int  snmp_engine_walk (snmp_host *host, uint64_t interval, uint64_t timeout,
+                       struct asn_oid *oid, snmp_walk_response func, void *data);
+
+void snmp_engine_walk_cancel (int walk);
+
 void snmp_engine_flush (void);
 
 int  snmp_engine_sync (const char* host, const char *port, const char* community,
@@ -41,6 +41,7 @@
 #include <unistd.h>
 #include <syslog.h>
 #include <dirent.h>
+#include <limits.h>
 #include <string.h>
 #include <err.h>
 
@@ -61,8 +62,19 @@ typedef struct _config_ctx
     const char* confname;
     file_path* rrdlist;
     file_path* rawlist;
+    file_path* agglist;
+    uint aggregate;
+
+    /* All times are in milliseconds */
     uint interval;
     uint timeout;
+    uint timeout_min;
+    uint timeout_max;
+    uint throttle;
+    uint discover;
+    uint heartbeat;
+    int stream;
+    int hedge;
     rb_item* items;
 }
 config_ctx;
@@ -74,26 +86,82 @@ config_ctx;
 #define CONFIG_GENERAL "general"
 #define CONFIG_RRD "rrd"
 #define CONFIG_RAW "raw"
+#define CONFIG_RAW_AGGREGATE "raw-aggregate"
+#define CONFIG_STREAM "stream"
 #define CONFIG_POLL "poll"
 #define CONFIG_INTERVAL "interval"
 #define CONFIG_TIMEOUT "timeout"
+#define CONFIG_TIMEOUT_MIN "timeout-min"
+#define CONFIG_TIMEOUT_MAX "timeout-max"
+#define CONFIG_THROTTLE "throttle"
+#define CONFIG_HEDGE "hedge"
+#define CONFIG_HEARTBEAT "heartbeat"
+#define CONFIG_AGGREGATE "aggregate"
 #define CONFIG_SOURCE "source"
+#define CONFIG_COLUMN "column"
+#define CONFIG_DISCOVER "discover"
 #define CONFIG_REFERENCE "reference"
+#define CONFIG_RATE "rate"
 
 #define CONFIG_SNMP "snmp"
 #define CONFIG_SNMP2 "snmp2"
 #define CONFIG_SNMP2C "snmp2c"
 
+/* Discovery runs every so many polls, unless configured */
+#define DEFAULT_DISCOVER_POLLS 10
+
+/* A field without its own heartbeat uses the one for the file */
+#define HEARTBEAT_UNSET ((mstime)-1)
+
 #define FIELD_VALID "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_-0123456789."
 
+/* Forward declaration */
+static void free_pollers(rb_poller* poll);
+
 /* -----------------------------------------------------------------------------
  * CONFIG LOADING
  */
 
+/*
+ * Times are in seconds, which may have a fraction, or in milliseconds
+ * with an 'ms' suffix. Returns the milliseconds, or zero when invalid.
+ */
+static uint
+parse_time(const char* value)
+{
+    double secs;
+    char* t;
+
+    secs = strtod(value, &t);
+    if(t == value || secs <= 0)
+        return 0;
+
+    if(strcmp(t, "ms") == 0)
+        secs /= 1000;
+    else if(*t && strcmp(t, "s") != 0)
+        return 0;
+
+    if(secs * 1000 < 1 || secs > UINT_MAX / 1000)
+        return 0;
+    return (uint)(secs * 1000 + 0.5);
+}
+
+/* Whole seconds are written as before, for the poller keys */
+static void
+format_time(char* buf, size_t len, uint ms)
+{
+    if(ms % 1000 == 0)
+        snprintf(buf, len, "%u", ms / 1000);
+    else
+        snprintf(buf, len, "%ums", ms);
+}
+
 static void
 config_done(config_ctx* ctx)
 {
     char key[MAXPATHLEN];
+    char interval[32];
+    char timeout[32];
     rb_item* it;
     rb_poller* poll;
     char *t;
@@ -106,7 +174,38 @@ config_done(config_ctx* ctx)
             errx(2, "%s: no interval specified", ctx->confname);
 
         if(ctx->timeout == 0)
-            ctx->timeout = g_state.timeout;
+            ctx->timeout = g_state.timeout * 1000;
+
+        /* Either bound turns on learning the timeout */
+        if(ctx->timeout_min || ctx->timeout_max)
+        {
+            if(ctx->timeout_max == 0)
+                ctx->timeout_max = ctx->interval;
+            if(ctx->timeout_min == 0)
+                ctx->timeout_min = ctx->timeout_max < 1000 ? ctx->timeout_max : 1000;
+            if(ctx->timeout_min > ctx->timeout_max)
+                errx(2, "%s: " CONFIG_TIMEOUT_MIN " must not be more than " CONFIG_TIMEOUT_MAX,
+                     ctx->confname);
+        }
+
+        if(ctx->discover == 0)
+            ctx->discover = ctx->interval * DEFAULT_DISCOVER_POLLS;
+        else if(ctx->discover < ctx->interval)
+            errx(2, "%s: " CONFIG_DISCOVER " must not be less than the " CONFIG_INTERVAL,
+                 ctx->confname);
+
+        if(ctx->agglist && !ctx->aggregate)
+            errx(2, "%s: " CONFIG_RAW_AGGREGATE " needs an " CONFIG_AGGREGATE " setting",
+                 ctx->confname);
+
+        for(it = ctx->items; it; it = it->next)
+        {
+            if(it->heartbeat == HEARTBEAT_UNSET)
+                it->heartbeat = it->is_column ? 0 : ctx->heartbeat;
+            if(it->heartbeat && it->heartbeat < ctx->interval)
+                errx(2, "%s: %s: " CONFIG_HEARTBEAT " must not be less than the " CONFIG_INTERVAL,
+                     ctx->confname, it->field);
+        }
 
         /* And a nice key for lookups 
          * The key uses the configuration file name if 1 or more rrd files
@@ -117,12 +216,14 @@ config_done(config_ctx* ctx)
          * These changes mean that configuration files using the same 
          * rrd files are no longer merged into a single poll.
          */
+        format_time(interval, sizeof(interval), ctx->interval);
+        format_time(timeout, sizeof(timeout), ctx->timeout);
         if(ctx->rrdlist)
-            snprintf(key, sizeof(key), "%d-%d:%s", ctx->timeout, ctx->interval,
+            snprintf(key, sizeof(key), "%s-%s:%s", timeout, interval,
                      ctx->confname);
         else
-            snprintf(key, sizeof(key), "%d-%d:%s/%s.rrd", ctx->timeout,
-                     ctx->interval, g_state.rrddir, ctx->confname);
+            snprintf(key, sizeof(key), "%s-%s:%s/%s.rrd", timeout,
+                     interval, g_state.rrddir, ctx->confname);
         key[sizeof(key) - 1] = 0;
 
         /* See if we have one of these pollers already */
@@ -147,9 +248,16 @@ config_done(config_ctx* ctx)
 
             poll->rawlist = ctx->rawlist;
             poll->rrdlist = ctx->rrdlist;
+            poll->agglist = ctx->agglist;
+            poll->aggregate = ctx->aggregate;
 
-            poll->interval = ctx->interval * 1000;
-            poll->timeout = ctx->timeout * 1000;
+            poll->interval = ctx->interval;
+            poll->timeout = ctx->timeout;
+            poll->timeout_min = ctx->timeout_min;
+            poll->timeout_max = ctx->timeout_max;
+            poll->throttle = ctx->throttle;
+            poll->stream = ctx->stream;
+            poll->hedge = ctx->hedge;
 
             /* Add it to the main lists */
             poll->next = g_state.polls;
@@ -161,11 +269,18 @@ config_done(config_ctx* ctx)
         }
 
         /* Get the last item and add to the list */
-        for(it = ctx->items; it->next; it = it->next)
+        for(it = ctx->items; it->next; it = it->next) {
             it->poller = poll;
+            it->discover_interval = ctx->discover;
+        }
 
         ASSERT(it);
         it->poller = poll;
+        it->discover_interval = ctx->discover;
+
+        /* The last item in the list is the first in the file */
+        if(!poll->agent)
+            poll->agent = it->hostnames[0];
 
         /* Add the items to this poller */
         it->next = poll->items;
@@ -183,8 +298,17 @@ config_done(config_ctx* ctx)
     ctx->items = NULL;
     ctx->rrdlist = NULL;
     ctx->rawlist = NULL;
+    ctx->agglist = NULL;
+    ctx->aggregate = 0;
     ctx->interval = 0;
     ctx->timeout = 0;
+    ctx->timeout_min = 0;
+    ctx->timeout_max = 0;
+    ctx->throttle = 0;
+    ctx->discover = 0;
+    ctx->heartbeat = 0;
+    ctx->stream = 0;
+    ctx->hedge = 0;
 }
 
 static void
@@ -257,7 +381,6 @@ parse_query (rb_item *item, char *query, config_ctx *ctx)
 	item->query_match = value;
 	memset (&item->query_last, 0, sizeof (item->query_last));
 	item->query_matched = 0;
-	item->query_searched = 0;
 }
 
 static rb_item*
@@ -306,6 +429,7 @@ parse_item (const char *field, char *uri, config_ctx *ctx)
 
 	item->poller = NULL; /* Set later in config_done */
 	item->vtype = VALUE_UNSET;
+	item->heartbeat = HEARTBEAT_UNSET;
 	item->portnum = port ? port : "161";
 
 	/* Parse the hosts, query */
@@ -338,6 +462,57 @@ parse_item_reference (const char *field, char *reference, config_ctx *ctx)
     return NULL;
 }
 
+static rb_item*
+parse_item_rate (const char *field, const char *value, config_ctx *ctx)
+{
+    rb_item *item;
+
+    for(item = ctx->items; item; item = item->next) {
+        if(strcmp(field, item->field) == 0) {
+            item->is_rate = strtob(value);
+            if(item->is_rate == -1)
+                errx(2, "%s: %s." CONFIG_RATE " must be 'yes' or 'no': %s",
+                     ctx->confname, field, value);
+            if(item->is_rate && item->is_column)
+                errx(2, "%s: %s." CONFIG_RATE " can't be used with a column",
+                     ctx->confname, field);
+            return item;
+        }
+    }
+
+    log_warnx ("%s: field %s not found", ctx->confname, field);
+    return NULL;
+}
+
+static rb_item*
+parse_item_heartbeat (const char *field, const char *value, config_ctx *ctx)
+{
+    rb_item *item;
+
+    for(item = ctx->items; item; item = item->next) {
+        if(strcmp(field, item->field) == 0) {
+            if(item->is_column)
+                errx(2, "%s: %s." CONFIG_HEARTBEAT " can't be used with a column",
+                     ctx->confname, field);
+
+            /* Turned off for just this field */
+            if(strtob(value) == 0) {
+                item->heartbeat = 0;
+                return item;
+            }
+
+            item->heartbeat = parse_time(value);
+            if(item->heartbeat == 0)
+                errx(2, "%s: %s." CONFIG_HEARTBEAT " must be a time (seconds, or with 'ms') or 'no': %s",
+                     ctx->confname, field, value);
+            return item;
+        }
+    }
+
+    log_warnx ("%s: field %s not found", ctx->confname, field);
+    return NULL;
+}
+
 static void
 config_value(const char* header, const char* name, char* value,
              config_ctx* ctx)
@@ -364,6 +539,23 @@ config_value(const char* header, const char* name, char* value,
             ctx->rawlist = p;
         }
 
+        if(strcmp(name, CONFIG_RAW_AGGREGATE) == 0)
+        {
+            file_path *p = (file_path*)xcalloc(sizeof(*p));
+            p->path = value;
+            /* Add the new path to the aggregate list */
+            p->next = ctx->agglist;
+            ctx->agglist = p;
+        }
+
+        if(strcmp(name, CONFIG_STREAM) == 0)
+        {
+            ctx->stream = strtob(value);
+            if(ctx->stream == -1)
+                errx(2, "%s: " CONFIG_STREAM " must be 'yes' or 'no': %s",
+                     ctx->confname, value);
+        }
+
         /* Ignore other [general] options */
         return;
     }
@@ -372,36 +564,109 @@ config_value(const char* header, const char* name, char* value,
         return;
 
     if(strcmp(name, CONFIG_INTERVAL) == 0)
+    {
+        if(ctx->interval > 0)
+            errx(2, "%s: " CONFIG_INTERVAL " specified twice: %s", ctx->confname, value);
+
+        ctx->interval = parse_time(value);
+        if(ctx->interval == 0)
+            errx(2, "%s: " CONFIG_INTERVAL " must be a time (seconds, or with 'ms') greater than zero: %s",
+                ctx->confname, value);
+        return;
+    }
+
+    if(strcmp(name, CONFIG_TIMEOUT) == 0)
+    {
+        if(ctx->timeout > 0)
+            errx(2, "%s: " CONFIG_TIMEOUT " specified twice: %s", ctx->confname, value);
+
+        ctx->timeout = parse_time(value);
+        if(ctx->timeout == 0)
+            errx(2, "%s: " CONFIG_TIMEOUT " must be a time (seconds, or with 'ms') greater than zero: %s",
+                ctx->confname, value);
+        return;
+    }
+
+    if(strcmp(name, CONFIG_TIMEOUT_MIN) == 0 ||
+       strcmp(name, CONFIG_TIMEOUT_MAX) == 0)
+    {
+        uint* bound;
+
+        bound = strcmp(name, CONFIG_TIMEOUT_MIN) == 0 ? &ctx->timeout_min : &ctx->timeout_max;
+        if(*bound > 0)
+            errx(2, "%s: %s specified twice: %s", ctx->confname, name, value);
+
+        *bound = parse_time(value);
+        if(*bound == 0)
+            errx(2, "%s: %s must be a time (seconds, or with 'ms') greater than zero: %s",
+                ctx->confname, name, value);
+        return;
+    }
+
+    if(strcmp(name, CONFIG_THROTTLE) == 0)
     {
         char* t;
         int i;
 
-        if(ctx->interval > 0)
-            errx(2, "%s: " CONFIG_INTERVAL " specified twice: %s", ctx->confname, value);
+        if(ctx->throttle > 0)
+            errx(2, "%s: " CONFIG_THROTTLE " specified twice: %s", ctx->confname, value);
 
         i = strtol(value, &t, 10);
         if(i < 1 || *t)
-            errx(2, "%s: " CONFIG_INTERVAL " must be a number (seconds) greater than zero: %s",
+            errx(2, "%s: " CONFIG_THROTTLE " must be a number (packets per second) greater than zero: %s",
                 ctx->confname, value);
 
-        ctx->interval = (uint32_t)i;
+        ctx->throttle = (uint32_t)i;
         return;
     }
 
-    if(strcmp(name, CONFIG_TIMEOUT) == 0)
+    if(strcmp(name, CONFIG_HEDGE) == 0)
+    {
+        ctx->hedge = strtob(value);
+        if(ctx->hedge == -1)
+            errx(2, "%s: " CONFIG_HEDGE " must be 'yes' or 'no': %s",
+                 ctx->confname, value);
+        return;
+    }
+
+    if(strcmp(name, CONFIG_AGGREGATE) == 0)
     {
         char* t;
         int i;
 
-        if(ctx->timeout > 0)
-            errx(2, "%s: " CONFIG_TIMEOUT " specified twice: %s", ctx->confname, value);
+        if(ctx->aggregate > 0)
+            errx(2, "%s: " CONFIG_AGGREGATE " specified twice: %s", ctx->confname, value);
 
         i = strtol(value, &t, 10);
         if(i < 1 || *t)
-            errx(2, "%s: " CONFIG_TIMEOUT " must be a a number (seconds) greater than zero: %s",
+            errx(2, "%s: " CONFIG_AGGREGATE " must be a number (of polls) greater than zero: %s",
+                ctx->confname, value);
+
+        ctx->aggregate = (uint)i;
+        return;
+    }
+
+    if(strcmp(name, CONFIG_HEARTBEAT) == 0)
+    {
+        if(ctx->heartbeat > 0)
+            errx(2, "%s: " CONFIG_HEARTBEAT " specified twice: %s", ctx->confname, value);
+
+        ctx->heartbeat = parse_time(value);
+        if(ctx->heartbeat == 0)
+            errx(2, "%s: " CONFIG_HEARTBEAT " must be a time (seconds, or with 'ms') greater than zero: %s",
                 ctx->confname, value);
+        return;
+    }
 
-        ctx->timeout = (uint32_t)i;
+    if(strcmp(name, CONFIG_DISCOVER) == 0)
+    {
+        if(ctx->discover > 0)
+            errx(2, "%s: " CONFIG_DISCOVER " specified twice: %s", ctx->confname, value);
+
+        ctx->discover = parse_time(value);
+        if(ctx->discover == 0)
+            errx(2, "%s: " CONFIG_DISCOVER " must be a time (seconds, or with 'ms') greater than zero: %s",
+                ctx->confname, value);
         return;
     }
 
@@ -413,10 +678,13 @@ config_value(const char* header, const char* name, char* value,
     *suffix = 0;
     suffix++;
 
-    /* If it starts with "field.source" */
-    if(strcmp(suffix, CONFIG_SOURCE) == 0)
+    /* If it starts with "field.source", "field.column" or "field.discover" */
+    if(strcmp(suffix, CONFIG_SOURCE) == 0 ||
+       strcmp(suffix, CONFIG_COLUMN) == 0 ||
+       strcmp(suffix, CONFIG_DISCOVER) == 0)
     {
         const char* t;
+        rb_item* item;
 
         /* Check the name */
         t = name + strspn(name, FIELD_VALID);
@@ -425,7 +693,15 @@ config_value(const char* header, const char* name, char* value,
                  ctx->confname, name);
 
         /* Parse out the field */
-        parse_item(name, value, ctx);
+        item = parse_item(name, value, ctx);
+
+        /* A whole column, with a value for each row */
+        if(item && strcmp(suffix, CONFIG_COLUMN) == 0)
+            item->is_column = 1;
+
+        /* An item for each row of the table, found at runtime */
+        if(item && strcmp(suffix, CONFIG_DISCOVER) == 0)
+            item->is_discover = 1;
     }
 
     /* If it starts with "field.reference" */
@@ -434,6 +710,96 @@ config_value(const char* header, const char* name, char* value,
         /* Parse out the field */
         parse_item_reference(name, value, ctx);
     }
+
+    /* If it starts with "field.rate" */
+    if(strcmp(suffix, CONFIG_RATE) == 0)
+    {
+        parse_item_rate(name, value, ctx);
+    }
+
+    /* If it starts with "field.heartbeat" */
+    if(strcmp(suffix, CONFIG_HEARTBEAT) == 0)
+    {
+        parse_item_heartbeat(name, value, ctx);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * SHARDING
+ */
+
+/*
+ * With -S each rrdbotd process only polls some of the configuration
+ * files, split up by the first agent each file polls. Other agents in a
+ * file that polls several can end up polled from more than one process,
+ * rather than splitting up a file. The agent is placed with a jump consistent
+ * hash, so that when the number of shards changes only as few agents as
+ * possible move to another shard.
+ */
+
+static uint64_t
+shard_hash(const char* name)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;   /* FNV-1a */
+
+    for(; *name; ++name)
+    {
+        hash ^= (unsigned char)*name;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint
+shard_jump(uint64_t key, uint shards)
+{
+    int64_t b = -1, j = 0;
+
+    while(j < (int64_t)shards)
+    {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1));
+    }
+
+    return (uint)b;
+}
+
+static uint
+shard_of(rb_poller* poll)
+{
+    return shard_jump(shard_hash(poll->agent), g_state.shards);
+}
+
+static void
+config_shard()
+{
+    rb_poller** at;
+    rb_poller* poll;
+    uint total = 0, kept = 0;
+
+    for(at = &g_state.polls; *at; )
+    {
+        poll = *at;
+        ++total;
+
+        if(shard_of(poll) == g_state.shard)
+        {
+            ++kept;
+            at = &poll->next;
+            continue;
+        }
+
+        /* Not for this process */
+        hsh_rem(g_state.poll_by_key, poll->key, -1);
+        *at = poll->next;
+        poll->next = NULL;
+        free_pollers(poll);
+    }
+
+    log_info("shard %u of %u: polling %u of %u configurations",
+             g_state.shard + 1, g_state.shards, kept, total);
 }
 
 void
@@ -451,6 +817,9 @@ rb_config_parse()
 
     if(!g_state.polls)
         errx(1, "no config files found in config directory: %s", g_state.confdir);
+
+    if(g_state.shards > 1)
+        config_shard();
 }
 
 /* -----------------------------------------------------------------------------
@@ -507,6 +876,7 @@ free_items(rb_item* item)
     for(; item; item = next)
     {
         next = item->next;
+        free(item->rows);
         free(item);
     }
 }
@@ -535,6 +905,12 @@ free_pollers(rb_poller* poll)
             poll->rawlist = fp;
         }
 
+        while(poll->agglist) {
+            fp = poll->agglist->next;
+            free(poll->agglist);
+            poll->agglist = fp;
+        }
+
         free(poll);
     }
 
@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2005, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#include "usuals.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "rrdbotd.h"
+#include "server-mainloop.h"
+
+/*
+ * Two or more rrdbotd processes can split the polling between them, and
+ * take over for each other. Each sends a heartbeat over UDP to the others
+ * every second. The agents, the first one of each configuration file as
+ * with -S, are split between the peers that are heard from with
+ * rendezvous hashing: each agent goes to the peer whose name
+ * hashes highest along with it. So when a peer goes silent only its own
+ * agents move, spread over the others, and they move back when it returns.
+ *
+ * Peers are named by the address they listen on, as given with -a and -A.
+ * All the peers need to be given the same names for each other.
+ */
+
+#define PEER_MAGIC      "rrdbotd-peer "
+#define PEER_HEARTBEAT  1000        /* How often a heartbeat is sent */
+#define PEER_SILENT     3500        /* When a peer counts as gone */
+
+typedef struct _peer
+{
+    const char* name;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+
+    mstime seen;
+    int alive;
+
+    struct _peer* next;
+}
+peer;
+
+static peer* peer_list = NULL;
+static int peer_fd = -1;
+
+static void
+peer_resolve(const char* name, struct sockaddr_storage* addr, socklen_t* addr_len)
+{
+    struct addrinfo hints, *ai;
+    char host[MAXPATHLEN];
+    char* port;
+    int r;
+
+    strncpy(host, name, sizeof(host));
+    host[sizeof(host) - 1] = 0;
+
+    /* The port is after the last colon, and the host may be in brackets */
+    port = strrchr(host, ':');
+    if(!port)
+        errx(1, "peer address must have a port: %s", name);
+    *(port++) = 0;
+    if(host[0] == '[' && port[-2] == ']')
+    {
+        port[-2] = 0;
+        memmove(host, host + 1, strlen(host));
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    r = getaddrinfo(host, port, &hints, &ai);
+    if(r != 0)
+        errx(1, "couldn't resolve peer address '%s': %s", name, gai_strerror(r));
+
+    if(ai->ai_addrlen > sizeof(*addr))
+        errx(1, "resolve address is too big");
+    memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+    *addr_len = ai->ai_addrlen;
+
+    freeaddrinfo(ai);
+}
+
+/* The weight of an agent for a peer, the highest gets it */
+static uint64_t
+peer_weight(const char* name, const char* agent)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;   /* FNV-1a */
+    const char* p;
+
+    for(p = name; *p; ++p)
+        hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+    hash = (hash ^ '/') * 0x100000001b3ULL;
+    for(p = agent; *p; ++p)
+        hash = (hash ^ (unsigned char)*p) * 0x100000001b3ULL;
+
+    /* Mixed well, as the names are very much alike */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static void
+peer_assign()
+{
+    rb_poller* poll;
+    uint64_t weight, best;
+    const char* owner;
+    uint total = 0, ours = 0;
+    peer* p;
+
+    for(poll = g_state.polls; poll; poll = poll->next)
+    {
+        owner = g_state.peer_name;
+        best = peer_weight(owner, poll->agent);
+
+        for(p = peer_list; p; p = p->next)
+        {
+            if(!p->alive)
+                continue;
+            weight = peer_weight(p->name, poll->agent);
+            if(weight > best)
+            {
+                best = weight;
+                owner = p->name;
+            }
+        }
+
+        poll->idle = (owner != g_state.peer_name);
+
+        ++total;
+        if(!poll->idle)
+            ++ours;
+    }
+
+    log_info("peers: polling %u of %u configurations", ours, total);
+}
+
+static void
+peer_receive(int fd, int type, void* arg)
+{
+    char buf[MAXPATHLEN + 32];
+    const char* name;
+    ssize_t len;
+    peer* p;
+
+    len = recv(fd, buf, sizeof(buf) - 1, 0);
+    if(len < 0)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+            log_error("error receiving peer heartbeat");
+        return;
+    }
+
+    buf[len] = 0;
+    if(strncmp(buf, PEER_MAGIC, strlen(PEER_MAGIC)) != 0)
+    {
+        log_debug("invalid peer heartbeat received");
+        return;
+    }
+
+    name = buf + strlen(PEER_MAGIC);
+    for(p = peer_list; p; p = p->next)
+    {
+        if(strcmp(p->name, name) == 0)
+            break;
+    }
+
+    if(!p)
+    {
+        log_warnx("heartbeat received from unknown peer: %s", name);
+        return;
+    }
+
+    p->seen = server_get_time();
+    if(!p->alive)
+    {
+        log_info("peer is back, handing back its share: %s", p->name);
+        p->alive = 1;
+        peer_assign();
+    }
+}
+
+static int
+peer_timer(mstime when, void* arg)
+{
+    char buf[MAXPATHLEN + 32];
+    int changed = 0;
+    size_t len;
+    peer* p;
+
+    len = snprintf(buf, sizeof(buf), PEER_MAGIC "%s", g_state.peer_name);
+
+    for(p = peer_list; p; p = p->next)
+    {
+        if(sendto(peer_fd, buf, len, 0, (struct sockaddr*)&p->addr, p->addr_len) < 0)
+            log_debug("couldn't send heartbeat to peer: %s: %s", p->name, strerror(errno));
+
+        if(p->alive && when - p->seen > PEER_SILENT)
+        {
+            log_info("peer has gone silent, taking over its share: %s", p->name);
+            p->alive = 0;
+            changed = 1;
+        }
+    }
+
+    if(changed)
+        peer_assign();
+
+    return 1;
+}
+
+void
+rb_peers_init()
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    const char** name;
+    peer* p;
+
+    if(!g_state.peer_name)
+        return;
+
+    peer_resolve(g_state.peer_name, &addr, &addr_len);
+
+    peer_fd = socket(addr.ss_family, SOCK_DGRAM, 0);
+    if(peer_fd < 0)
+        err(1, "couldn't open peer socket");
+    if(bind(peer_fd, (struct sockaddr*)&addr, addr_len) < 0)
+        err(1, "couldn't listen on peer address '%s'", g_state.peer_name);
+    if(server_watch(peer_fd, SERVER_READ, peer_receive, NULL) == -1)
+        err(1, "couldn't watch peer socket");
+
+    /* Until they've had a chance to be heard from, all peers count */
+    for(name = g_state.peers; name && *name; ++name)
+    {
+        p = (peer*)xcalloc(sizeof(*p));
+        p->name = *name;
+        peer_resolve(p->name, &p->addr, &p->addr_len);
+        p->seen = server_get_time();
+        p->alive = 1;
+
+        p->next = peer_list;
+        peer_list = p;
+    }
+
+    if(server_timer(PEER_HEARTBEAT, peer_timer, NULL) == -1)
+        err(1, "couldn't setup peer timer");
+
+    peer_assign();
+}
+
+void
+rb_peers_uninit()
+{
+    peer* next;
+
+    if(peer_fd != -1)
+    {
+        server_unwatch(peer_fd);
+        close(peer_fd);
+        peer_fd = -1;
+    }
+
+    for(; peer_list; peer_list = next)
+    {
+        next = peer_list->next;
+        free(peer_list);
+    }
+}
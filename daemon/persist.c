@@ -0,0 +1,397 @@
+/*
+ * Copyright (c) 2005, Stefan Walter
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ *
+ * CONTRIBUTORS
+ *  Stef Walter <stef@memberwebs.com>
+ *
+ */
+
+#include "usuals.h"
+
+#include <err.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "rrdbotd.h"
+#include "server-mainloop.h"
+
+/*
+ * On restart we'd otherwise forget every table index found by queries,
+ * and every host address resolved. The first poll would then search all
+ * the tables and resolve all the host names at once. Timeouts learned
+ * from response times, the response times used to choose between
+ * alternate hosts, and the last counter values for rates would also all
+ * start over. So these are saved in a file in the work directory, one
+ * per line, tab separated:
+ *
+ *   address   hostname   numeric-address
+ *   query     poller-key   field   oid
+ *   latency   hostname   milliseconds   when
+ *   timing    poller-key   timeout   response-times
+ *   rate      poller-key   field   value   when
+ *
+ * The response times are comma separated, and the value of a rate has
+ * 'i' or 'f' in front for integers or floating point. Rates are only
+ * used when the last value is recent, or counters may have wrapped
+ * around more than once since.
+ *
+ * Processes that share the polling, with -S or -A, may share the work
+ * directory too, so each has its own file.
+ */
+
+#define STATE_FILE      "rrdbotd.state"
+#define STATE_INTERVAL  (5 * 60 * 1000)     /* Also saved this often */
+#define STATE_LINE      (MAXPATHLEN + 1024)
+#define STATE_FIELDS    5
+#define STATE_STALE     10                  /* Polls before a rate is stale */
+
+static char state_path[MAXPATHLEN];
+
+static int
+parse_oid(const char* str, struct asn_oid* oid)
+{
+    unsigned long sub;
+    char* t;
+
+    oid->len = 0;
+    while(*str)
+    {
+        if(oid->len >= ASN_MAXOIDLEN)
+            return -1;
+        sub = strtoul(str, &t, 10);
+        if(t == str || (*t && *t != '.'))
+            return -1;
+        oid->subs[oid->len++] = (asn_subid_t)sub;
+        str = *t ? t + 1 : t;
+    }
+
+    return oid->len ? 0 : -1;
+}
+
+static int
+load_query(char* key, char* field, char* value)
+{
+    struct asn_oid oid;
+    rb_poller* poll;
+    rb_item* item;
+
+    poll = (rb_poller*)hsh_get(g_state.poll_by_key, key, -1);
+    if(!poll || parse_oid(value, &oid) < 0)
+        return 0;
+
+    for(item = poll->items; item; item = item->next)
+    {
+        if(!item->has_query || item->is_column || item->is_discover ||
+           strcmp(item->field, field) != 0)
+            continue;
+
+        /* The configured query may have changed since */
+        if(oid.len <= item->query_oid.len ||
+           !asn_is_suboid(&item->query_oid, &oid))
+            return 0;
+
+        item->query_last = oid;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+load_timing(char* key, char* timeout, char* samples)
+{
+    rb_poller* poll;
+    unsigned long value;
+    char* t;
+    uint n;
+
+    poll = (rb_poller*)hsh_get(g_state.poll_by_key, key, -1);
+    if(!poll || (!poll->timeout_max && !poll->hedge))
+        return 0;
+
+    for(n = 0; *samples && n < LATENCY_SAMPLES; ++n)
+    {
+        value = strtoul(samples, &t, 10);
+        if(t == samples || (*t && *t != ','))
+            return 0;
+        poll->latency[n] = value;
+        samples = *t ? t + 1 : t;
+    }
+    poll->n_latency = n;
+
+    /* A learned timeout, as long as the bounds still allow it */
+    value = strtoul(timeout, &t, 10);
+    if(poll->timeout_max && !*t &&
+       value >= poll->timeout_min && value <= poll->timeout_max)
+    {
+        poll->timeout = value;
+        poll->timeout_reported = value;
+    }
+
+    return 1;
+}
+
+static int
+load_rate(char* key, char* field, char* value, char* at)
+{
+    rb_poller* poll;
+    rb_item* item;
+    mstime when;
+    char* t;
+
+    poll = (rb_poller*)hsh_get(g_state.poll_by_key, key, -1);
+    if(!poll)
+        return 0;
+
+    when = strtoull(at, &t, 10);
+    if(*t || !when || server_get_time() - when > poll->interval * STATE_STALE)
+        return 0;
+
+    for(item = poll->items; item; item = item->next)
+    {
+        if(!item->is_rate || item->is_column || item->is_discover ||
+           strcmp(item->field, field) != 0)
+            continue;
+
+        if(value[0] == 'i')
+        {
+            item->rate_last.i_value = strtoll(value + 1, &t, 10);
+            item->rate_vtype = VALUE_REAL;
+        }
+        else if(value[0] == 'f')
+        {
+            item->rate_last.f_value = strtod(value + 1, &t);
+            item->rate_vtype = VALUE_FLOAT;
+        }
+        else
+            return 0;
+
+        if(t == value + 1 || *t)
+            return 0;
+
+        item->rate_at = when;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void
+save_address(const char* hostname, const char* address, void* arg)
+{
+    fprintf((FILE*)arg, "address\t%s\t%s\n", hostname, address);
+}
+
+static void
+save_latency(const char* hostname, uint64_t latency, uint64_t at, void* arg)
+{
+    fprintf((FILE*)arg, "latency\t%s\t%"PRIu64"\t%"PRIu64"\n", hostname, latency, at);
+}
+
+static void
+save_timing(FILE* f, rb_poller* poll)
+{
+    uint i, n;
+
+    n = poll->n_latency < LATENCY_SAMPLES ? poll->n_latency : LATENCY_SAMPLES;
+    if(!n)
+        return;
+
+    fprintf(f, "timing\t%s\t%u\t", poll->key, (uint)poll->timeout);
+    for(i = 0; i < n; ++i)
+        fprintf(f, i ? ",%u" : "%u", (uint)poll->latency[i]);
+    fputc('\n', f);
+}
+
+static int
+save_timer(mstime when, void* arg)
+{
+    rb_persist_save();
+    return 1;
+}
+
+void
+rb_persist_init()
+{
+    char line[STATE_LINE];
+    char cwd[MAXPATHLEN];
+    char name[MAXPATHLEN];
+    char* fields[STATE_FIELDS];
+    int addresses = 0;
+    int queries = 0;
+    int timings = 0;
+    int rates = 0;
+    FILE* f;
+    int n;
+
+    if(g_state.peer_name)
+        snprintf(name, sizeof(name), STATE_FILE ".%s", g_state.peer_name);
+    else if(g_state.shards > 1)
+        snprintf(name, sizeof(name), STATE_FILE ".%u-of-%u", g_state.shard + 1, g_state.shards);
+    else
+        snprintf(name, sizeof(name), STATE_FILE);
+
+    /* The daemon changes directory, so keep this absolute */
+    if(g_state.rrddir[0] != '/' && getcwd(cwd, sizeof(cwd)))
+        n = snprintf(state_path, sizeof(state_path), "%s/%s/%s", cwd, g_state.rrddir, name);
+    else
+        n = snprintf(state_path, sizeof(state_path), "%s/%s", g_state.rrddir, name);
+    if(n < 0 || n >= (int)sizeof(state_path))
+        errx(1, "state file path is too long: %s", g_state.rrddir);
+
+    if(server_timer(STATE_INTERVAL, save_timer, NULL) == -1)
+        err(1, "couldn't setup timer");
+
+    f = fopen(state_path, "r");
+    if(!f)
+    {
+        if(errno != ENOENT)
+            log_error("couldn't open state file: %s", state_path);
+        return;
+    }
+
+    while(fgets(line, sizeof(line), f))
+    {
+        line[strcspn(line, "\n")] = 0;
+
+        /* Split the tab separated fields */
+        fields[0] = line;
+        for(n = 1; n < STATE_FIELDS; ++n)
+        {
+            fields[n] = strchr(fields[n - 1], '\t');
+            if(!fields[n])
+                break;
+            *(fields[n]++) = 0;
+        }
+
+        if(n == 3 && strcmp(fields[0], "address") == 0)
+        {
+            snmp_engine_address(fields[1], fields[2]);
+            ++addresses;
+        }
+        else if(n == 4 && strcmp(fields[0], "query") == 0)
+        {
+            queries += load_query(fields[1], fields[2], fields[3]);
+        }
+        else if(n == 4 && strcmp(fields[0], "latency") == 0)
+        {
+            snmp_engine_latency(fields[1], strtoull(fields[2], NULL, 10),
+                                strtoull(fields[3], NULL, 10));
+        }
+        else if(n == 4 && strcmp(fields[0], "timing") == 0)
+        {
+            timings += load_timing(fields[1], fields[2], fields[3]);
+        }
+        else if(n == 5 && strcmp(fields[0], "rate") == 0)
+        {
+            rates += load_rate(fields[1], fields[2], fields[3], fields[4]);
+        }
+    }
+
+    if(ferror(f))
+        log_error("couldn't read state file: %s", state_path);
+    fclose(f);
+
+    log_debug("loaded state: %d addresses, %d table indexes, %d timeouts, %d rates",
+              addresses, queries, timings, rates);
+}
+
+void
+rb_persist_save()
+{
+    char path[MAXPATHLEN + 8];
+    char buf[ASN_OIDSTRLEN];
+    rb_poller* poll;
+    rb_item* item;
+    FILE* f;
+    int fd;
+
+    if(!state_path[0])
+        return;
+
+    /* Written aside, and then moved into place */
+    snprintf(path, sizeof(path), "%s.XXXXXX", state_path);
+    fd = mkstemp(path);
+    f = fd == -1 ? NULL : fdopen(fd, "w");
+    if(!f)
+    {
+        log_error("couldn't write state file: %s", path);
+        if(fd != -1)
+        {
+            close(fd);
+            unlink(path);
+        }
+        return;
+    }
+
+    snmp_engine_addresses(save_address, f);
+    snmp_engine_latencies(save_latency, f);
+
+    for(poll = g_state.polls; poll; poll = poll->next)
+    {
+        save_timing(f, poll);
+
+        for(item = poll->items; item; item = item->next)
+        {
+            if(item->is_column || item->is_discover)
+                continue;
+
+            if(item->has_query && item->query_last.len)
+                fprintf(f, "query\t%s\t%s\t%s\n", poll->key, item->field,
+                        asn_oid2str_r(&item->query_last, buf));
+
+            if(item->is_rate && item->rate_at && item->rate_vtype == VALUE_REAL)
+                fprintf(f, "rate\t%s\t%s\ti%"PRId64"\t%"PRIu64"\n", poll->key,
+                        item->field, item->rate_last.i_value, item->rate_at);
+            else if(item->is_rate && item->rate_at && item->rate_vtype == VALUE_FLOAT)
+                fprintf(f, "rate\t%s\t%s\tf%.17g\t%"PRIu64"\n", poll->key,
+                        item->field, item->rate_last.f_value, item->rate_at);
+        }
+    }
+
+    if(ferror(f) | fclose(f))
+    {
+        log_error("couldn't write state file: %s", path);
+        unlink(path);
+        return;
+    }
+
+    if(rename(path, state_path) < 0)
+    {
+        log_error("couldn't replace state file: %s", state_path);
+        unlink(path);
+        return;
+    }
+
+    log_debug("saved state file: %s", state_path);
+}
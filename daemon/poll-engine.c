@@ -57,36 +57,268 @@
  * PACKET HANDLING
  */
 
+/* The most fields handed to the engine in one go */
+#define MAX_BATCH 64
+
 static void
-complete_requests (rb_item *item, int code)
+item_host (rb_item *item)
+{
+	int i;
+
+	/* All the alternates, so that their response times are known */
+	for (i = 0; i < item->n_hostnames; ++i) {
+		item->hosts[i] = snmp_engine_host (item->hostnames[i], item->portnum,
+		                                   item->community, item->version,
+		                                   item->poller->interval);
+		if (item->hosts[i] && item->poller->throttle)
+			snmp_engine_throttle (item->hosts[i], item->poller->throttle);
+	}
+
+	item->host = item->hosts[item->hostindex];
+}
+
+/*
+ * Of the alternate hosts, the one with the lowest smoothed response time
+ * is used, see snmp_engine_host_latency(). Hosts without any yet count
+ * as fastest so that each is tried. The current host has an edge, so
+ * that hosts which are about as fast don't take turns.
+ */
+
+#define ALTERNATE_EDGE    4       /* Current host gets 1/4 off its time */
+#define ALTERNATE_SLACK   5       /* And this many milliseconds */
+
+static int
+item_alternate (rb_item *item, int avoid)
+{
+	uint64_t latency, best_latency = 0;
+	int i, best = -1;
+
+	for (i = 0; i < item->n_hostnames; ++i) {
+		if (i == avoid || !item->hosts[i])
+			continue;
+		if (snmp_engine_host_down (item->hosts[i]))
+			continue;
+
+		latency = snmp_engine_host_latency (item->hosts[i]);
+		if (i == item->hostindex) {
+			latency -= latency / ALTERNATE_EDGE;
+			latency = latency > ALTERNATE_SLACK ? latency - ALTERNATE_SLACK : 0;
+		}
+
+		if (best < 0 || latency < best_latency ||
+		    (latency == best_latency && i == item->hostindex)) {
+			best = i;
+			best_latency = latency;
+		}
+	}
+
+	return best;
+}
+
+static void
+item_choose (rb_item *item, int avoid)
 {
 	int host;
 
+	host = item_alternate (item, avoid);
+
+	/* None are any good, so just go round in turn */
+	if (host < 0 && avoid >= 0)
+		host = (avoid + 1) % item->n_hostnames;
+
+	if (host < 0 || host == item->hostindex)
+		return;
+
+	log_debug ("using host for field '%s': %s", item->field, item->hostnames[host]);
+	item->hostindex = host;
+	item->host = item->hosts[host];
+}
+
+/*
+ * With pacing, when a response arrives depends mostly on the request's
+ * place in the queue. So values are noted at the time of the poll.
+ */
+static mstime
+polled_time (mstime requested, mstime when)
+{
+	if (g_state.pace_rate || g_state.pace_percent)
+		return requested;
+	return when;
+}
+
+/*
+ * With timeout-min or timeout-max configured, the timeout of a poller is
+ * learned from how long responses take. It's a multiple of the recent
+ * 95th percentile, within the bounds. Requests that time out count as
+ * taking the whole timeout, so that it grows when it's too short.
+ */
+
+#define LATENCY_MINIMUM   16      /* Samples before the timeout changes */
+#define LATENCY_MARGIN    3       /* Timeout as a multiple of the percentile */
+
+static void
+latency_note (rb_poller *poll, mstime latency)
+{
+	if (!poll->timeout_max && !poll->hedge)
+		return;
+	poll->latency[poll->n_latency++ % LATENCY_SAMPLES] = latency;
+	if (poll->n_latency >= LATENCY_SAMPLES * 2)
+		poll->n_latency -= LATENCY_SAMPLES;
+}
+
+static int
+latency_compare (const void *a, const void *b)
+{
+	mstime la = *(const mstime*)a;
+	mstime lb = *(const mstime*)b;
+	return la < lb ? -1 : (la > lb ? 1 : 0);
+}
+
+static int
+latency_percentile (rb_poller *poll, uint percent, mstime *latency)
+{
+	mstime sorted[LATENCY_SAMPLES];
+	uint n;
+
+	n = poll->n_latency < LATENCY_SAMPLES ? poll->n_latency : LATENCY_SAMPLES;
+	if (n < LATENCY_MINIMUM)
+		return 0;
+
+	memcpy (sorted, poll->latency, n * sizeof (mstime));
+	qsort (sorted, n, sizeof (mstime), latency_compare);
+
+	*latency = sorted[(n * percent) / 100];
+	return 1;
+}
+
+static void
+latency_timeout (rb_poller *poll)
+{
+	mstime timeout, change;
+
+	if (!poll->timeout_max)
+		return;
+
+	if (!latency_percentile (poll, 95, &timeout))
+		return;
+
+	timeout *= LATENCY_MARGIN;
+	if (timeout < poll->timeout_min)
+		timeout = poll->timeout_min;
+	if (timeout > poll->timeout_max)
+		timeout = poll->timeout_max;
+
+	poll->timeout = timeout;
+
+	/* Only log when it has moved a good bit */
+	change = timeout > poll->timeout_reported ?
+	         timeout - poll->timeout_reported : poll->timeout_reported - timeout;
+	if (!poll->timeout_reported || change * 4 > poll->timeout_reported) {
+		log_info ("timeout for %s is now %u ms", poll->key, (uint)timeout);
+		poll->timeout_reported = timeout;
+	}
+}
+
+/* An item still has requests or walks in flight */
+#define ITEM_BUSY(item) \
+	((item)->field_request || (item)->hedge_request || (item)->query_request || \
+	 (item)->query_table || (item)->column_walk)
+
+/* Forward declaration */
+static void table_leave (rb_item *item);
+
+/* The item has nothing more outstanding in this poll */
+static void
+item_done (rb_item *item)
+{
+	if (!item->pending)
+		return;
+
+	item->pending = 0;
+	ASSERT (item->poller->outstanding > 0);
+	--item->poller->outstanding;
+}
+
+/* As above, and hands on the value right away when streaming */
+static void
+item_finish (rb_item *item)
+{
+	if (!item->pending)
+		return;
+
+	if (item->poller->stream) {
+
+		/* Queries that didn't match go out as unset */
+		if (item->has_query && !item->is_column && !item->query_matched) {
+			item->last_polled = polled_time (item->last_request, server_get_time ());
+			item->vtype = VALUE_UNSET;
+		}
+
+		rb_rrd_update_item (item->poller, item);
+	}
+
+	item_done (item);
+}
+
+/* Items that couldn't send anything are done right away */
+static void
+item_sent (rb_item *item)
+{
+	if (!ITEM_BUSY (item))
+		item_finish (item);
+}
+
+static void
+complete_requests (rb_item *item, int code)
+{
 	ASSERT (item);
 
 	if (item->field_request)
 		snmp_engine_cancel (item->field_request);
 	item->field_request = 0;
+	if (item->hedge_request)
+		snmp_engine_cancel (item->hedge_request);
+	item->hedge_request = 0;
 	if (item->query_request)
 		snmp_engine_cancel (item->query_request);
 	item->query_request = 0;
-
-	/* If we have multiple host names then try the next host */
-	if (code != SNMP_ERR_NOERROR) {
-		host = (item->hostindex + 1) % item->n_hostnames;
-		if (host != item->hostindex) {
-			log_debug ("request failed, trying new host: %s", item->hostnames[host]);
-			item->hostindex = host;
-		}
+	if (item->query_table)
+		table_leave (item);
+	if (item->column_walk)
+		snmp_engine_walk_cancel (item->column_walk);
+	item->column_walk = 0;
+	item_finish (item);
+
+	/* If we have multiple host names then try another host */
+	if (code != SNMP_ERR_NOERROR && item->n_hostnames > 1) {
+		log_debug ("request failed for field '%s': %s", item->field,
+		           item->hostnames[item->hostindex]);
+		item_choose (item, item->hostindex);
 	}
 }
 
+/* The engine has marked the item's host down, so it's not polled */
+static void
+host_down (rb_item *item, mstime when)
+{
+	int i;
+
+	log_debug ("value for field '%s': host is down", item->field);
+
+	item->last_polled = when;
+	item->vtype = VALUE_UNSET;
+	for (i = 0; i < item->n_rows; ++i)
+		item->rows[i].vtype = VALUE_UNSET;
+
+	complete_requests (item, -1);
+}
+
 static void
 cancel_requests (rb_item *item, mstime when, const char *reason)
 {
 	ASSERT (item);
 	ASSERT (reason);
-	ASSERT (item->field_request || item->query_request);
+	ASSERT (ITEM_BUSY (item));
 
 	log_debug ("value for field '%s': %s", item->field, reason);
 
@@ -94,8 +326,10 @@ cancel_requests (rb_item *item, mstime when, const char *reason)
 	 * We note the failure has having taken place halfway between
 	 * the request and the current time.
 	 */
-	item->last_polled = item->last_request + ((when - item->last_request) / 2);
+	item->last_polled = polled_time (item->last_request,
+	                                 item->last_request + ((when - item->last_request) / 2));
 	item->vtype = VALUE_UNSET;
+	item->n_rows = 0;
 
 	complete_requests (item, -1);
 }
@@ -111,33 +345,38 @@ force_poll (rb_poller *poll, mstime when, const char *reason)
 
 	/* Now see if the all the requests are done */
 	for (item = poll->items; item; item = item->next) {
-		if (item->field_request || item->query_request) {
+		if (ITEM_BUSY (item)) {
+			latency_note (poll, poll->timeout);
 			cancel_requests (item, when, reason);
 			forced = 1;
 		}
-		ASSERT (!item->field_request);
-		ASSERT (!item->query_request);
+		ASSERT (!ITEM_BUSY (item));
+		item_done (item);
 	}
 
+	ASSERT (!poll->outstanding);
 	if (!forced && !poll->polling)
 		return;
 
 	/* Mark any non-matched queries as unset */
 	for (item = poll->items; item; item = item->next) {
-		if (item->has_query && !item->query_matched)
+		if (item->has_query && !item->is_column && !item->query_matched) {
 			/*
 			 * We note the failure has having taken place halfway between
 			 * the request and the current time.
 			 */
-			item->last_polled = item->last_request + ((when - item->last_request) / 2);
+			item->last_polled = polled_time (item->last_request,
+			                                 item->last_request + ((when - item->last_request) / 2));
 			item->vtype = VALUE_UNSET;
+		}
 	}
 
 	/*
 	 * We note the failure has having taken place halfway between
 	 * the request and the current time.
 	 */
-	poll->last_polled = poll->last_request + ((when - poll->last_request) / 2);
+	poll->last_polled = polled_time (poll->last_request,
+	                                 poll->last_request + ((when - poll->last_request) / 2));
 
 	/* And send off our collection of values */
 	rb_rrd_update (poll);
@@ -155,21 +394,19 @@ finish_poll (rb_poller *poll, mstime when)
 	ASSERT (poll->polling);
 
 	/* See if the all the requests are done */
-	for (item = poll->items; item; item = item->next) {
-		if (item->field_request || item->query_request)
-			return;
-	}
+	if (poll->outstanding)
+		return;
 
 	/* Mark any non-matched queries as unset */
 	for (item = poll->items; item; item = item->next) {
-		if (item->has_query && !item->query_matched) {
-			item->last_polled = when;
+		if (item->has_query && !item->is_column && !item->query_matched) {
+			item->last_polled = polled_time (item->last_request, when);
 			item->vtype = VALUE_UNSET;
 		}
 	}
 
 	/* Update the book-keeping */
-	poll->last_polled = when;
+	poll->last_polled = polled_time (poll->last_request, when);
 
 	/* And send off our collection of values */
 	rb_rrd_update (poll);
@@ -179,17 +416,17 @@ finish_poll (rb_poller *poll, mstime when)
 }
 
 static int
-parse_string_value (struct snmp_value *value, rb_item *item)
+parse_string_value (struct snmp_value *value, rb_value *v)
 {
 	char buf[256];
 	char *t, *b;
 
 	ASSERT (value);
 	ASSERT (value->syntax == SNMP_SYNTAX_OCTETSTRING);
-	ASSERT (item);
+	ASSERT (v);
 
 	if(value->v.octetstring.len >= sizeof(buf))
-		return 0;
+		return VALUE_UNSET;
 
 	memset(buf, 0, sizeof(buf));
 	strncpy(buf, (char*)value->v.octetstring.octets, value->v.octetstring.len);
@@ -201,84 +438,169 @@ parse_string_value (struct snmp_value *value, rb_item *item)
 
 	/* Cannot parse empty strings */
 	if(!*b)
-		return 0;
+		return VALUE_UNSET;
 
 	/* Try to parse the string into an integer */
-	item->v.i_value = strtoll(b, &t, 10);
-	if(!*t || isspace(*t)) {
-		item->vtype = VALUE_REAL;
-		return 1;
-	}
+	v->i_value = strtoll(b, &t, 10);
+	if(!*t || isspace(*t))
+		return VALUE_REAL;
 
 	/* Try to parse the string into a floating point */
-	item->v.f_value = strtod(b, &t);
-	if(!*t || isspace(*t)) {
-		item->vtype = VALUE_FLOAT;
-		return 1;
+	v->f_value = strtod(b, &t);
+	if(!*t || isspace(*t))
+		return VALUE_FLOAT;
+
+	return VALUE_UNSET;
+}
+
+/* Returns the value type, or -1 when it's not something we can store */
+static int
+parse_value (struct snmp_value *value, rb_value *v)
+{
+	int vtype = -1;
+
+	switch(value->syntax)
+	{
+	case SNMP_SYNTAX_NULL:
+		vtype = VALUE_UNSET;
+		break;
+	case SNMP_SYNTAX_INTEGER:
+		v->i_value = value->v.integer;
+		vtype = VALUE_REAL;
+		break;
+	case SNMP_SYNTAX_COUNTER:       /* FALLTHROUGH */
+	case SNMP_SYNTAX_GAUGE:         /* FALLTHROUGH */
+	case SNMP_SYNTAX_TIMETICKS:
+		v->i_value = value->v.uint32;
+		vtype = VALUE_REAL;
+		break;
+	case SNMP_SYNTAX_COUNTER64:
+		v->i_value = value->v.counter64;
+		vtype = VALUE_REAL;
+		break;
+	case SNMP_SYNTAX_OCTETSTRING:
+		vtype = parse_string_value(value, v);
+		if (vtype != VALUE_UNSET)
+			break;
+		vtype = -1;
+		/* FALLTHROUGH */
+	case SNMP_SYNTAX_OID: 		/* FALLTHROUGH */
+	case SNMP_SYNTAX_IPADDRESS:	/* FALLTHROUGH */
+	case SNMP_SYNTAX_NOSUCHOBJECT:	/* FALLTHROUGH */
+	case SNMP_SYNTAX_NOSUCHINSTANCE:/* FALLTHROUGH */
+	case SNMP_SYNTAX_ENDOFMIBVIEW:	/* FALLTHROUGH */
+	default:
+		break;
+	};
+
+	return vtype;
+}
+
+/*
+ * Items with rate turned on are written as the change per second since
+ * the last value. Counters that went down have wrapped when it's a 32
+ * bit counter and the change is less than half its range, otherwise the
+ * counter was reset, such as when the agent restarted. Those polls, and
+ * the first, are written as unknown.
+ */
+
+#define COUNTER32_RANGE  0x100000000ULL
+
+static void
+field_rate (rb_item *item, int syntax)
+{
+	uint64_t last, current, delta;
+	int counter, vtype;
+	rb_value v;
+	double change;
+
+	/* Nothing to compare, but what came before stays for the next */
+	if (item->vtype == VALUE_UNSET)
+		return;
+
+	v = item->v;
+	vtype = item->vtype;
+	item->vtype = VALUE_UNSET;
+
+	if (item->rate_at && item->last_polled > item->rate_at) {
+		counter = (syntax == SNMP_SYNTAX_COUNTER || syntax == SNMP_SYNTAX_COUNTER64);
+
+		if (vtype != item->rate_vtype) {
+			log_debug ("value for field '%s' changed type", item->field);
+
+		} else if (vtype == VALUE_FLOAT) {
+			change = v.f_value - item->rate_last.f_value;
+			item->v.f_value = change * 1000.0 / (item->last_polled - item->rate_at);
+			item->vtype = VALUE_FLOAT;
+
+		} else if (!counter) {
+			change = (double)(v.i_value - item->rate_last.i_value);
+			item->v.f_value = change * 1000.0 / (item->last_polled - item->rate_at);
+			item->vtype = VALUE_FLOAT;
+
+		} else {
+			last = (uint64_t)item->rate_last.i_value;
+			current = (uint64_t)v.i_value;
+
+			if (current >= last)
+				delta = current - last;
+			else if (syntax == SNMP_SYNTAX_COUNTER && last < COUNTER32_RANGE &&
+			         COUNTER32_RANGE - last + current < COUNTER32_RANGE / 2)
+				delta = COUNTER32_RANGE - last + current;
+			else
+				delta = 0, counter = 0;
+
+			if (counter) {
+				item->v.f_value = (double)delta * 1000.0 / (item->last_polled - item->rate_at);
+				item->vtype = VALUE_FLOAT;
+			} else {
+				log_debug ("counter for field '%s' was reset", item->field);
+			}
+		}
 	}
 
-	return 0;
+	item->rate_last = v;
+	item->rate_vtype = vtype;
+	item->rate_at = item->last_polled;
 }
 
 static void
-field_response (int request, int code, struct snmp_value *value, void *arg)
+field_value (rb_item *item, int code, struct snmp_value *value, mstime when)
 {
-	rb_item *item = arg;
-	mstime when;
 	char asnbuf[ASN_OIDSTRLEN];
+	int vtype;
 
-	ASSERT (request == item->field_request);
+	/* A failure waits while the other of a hedged pair is still out */
+	if (code != SNMP_ERR_NOERROR && (item->field_request || item->hedge_request))
+		return;
 
 	/* Note when the response for this item arrived */
-	when = server_get_time ();
-	item->last_polled = when;
+	item->last_polled = polled_time (item->last_request, when);
 
-	/* Mark this item as done */
-	item->field_request = 0;
+	/* And how long it took, timing out takes the whole timeout */
+	if (code == SNMP_ERR_NOERROR)
+		latency_note (item->poller, when - item->last_request);
+	else if (code == -1)
+		latency_note (item->poller, item->poller->timeout);
 
-	/* Errors result in us writing U */
-	if (code != SNMP_ERR_NOERROR) {
+	/* Errors or missing values result in us writing U */
+	if (code != SNMP_ERR_NOERROR || !value) {
 		item->vtype = VALUE_UNSET;
 
 	/* Parse the value from server */
 	} else {
-		switch(value->syntax)
-		{
-		case SNMP_SYNTAX_NULL:
-			item->vtype = VALUE_UNSET;
-			break;
-		case SNMP_SYNTAX_INTEGER:
-			item->v.i_value = value->v.integer;
-			item->vtype = VALUE_REAL;
-			break;
-		case SNMP_SYNTAX_COUNTER:       /* FALLTHROUGH */
-		case SNMP_SYNTAX_GAUGE:         /* FALLTHROUGH */
-		case SNMP_SYNTAX_TIMETICKS:
-			item->v.i_value = value->v.uint32;
-			item->vtype = VALUE_REAL;
-			break;
-		case SNMP_SYNTAX_COUNTER64:
-			item->v.i_value = value->v.counter64;
-			item->vtype = VALUE_REAL;
-			break;
-		case SNMP_SYNTAX_OCTETSTRING:
-			if (parse_string_value(value, item))
-				break;
-			/* FALLTHROUGH */
-		case SNMP_SYNTAX_OID: 		/* FALLTHROUGH */
-		case SNMP_SYNTAX_IPADDRESS:	/* FALLTHROUGH */
-		case SNMP_SYNTAX_NOSUCHOBJECT:	/* FALLTHROUGH */
-		case SNMP_SYNTAX_NOSUCHINSTANCE:/* FALLTHROUGH */
-		case SNMP_SYNTAX_ENDOFMIBVIEW:	/* FALLTHROUGH */
-		default:
+		vtype = parse_value (value, &item->v);
+		if (vtype >= 0)
+			item->vtype = vtype;
+		if (vtype >= 0 && item->is_rate)
+			field_rate (item, value->syntax);
+		else if (vtype < 0)
 			log_warnx("snmp server %s: oid %s: field %s: response %s(%u)",
 			    item->hostnames[item->hostindex],
 			    asn_oid2str_r(&item->field_oid, asnbuf),
 			    item->field,
 			    snmp_get_syntaxmsg(value->syntax),
 			    value->syntax);
-			break;
-		};
 
 		if (item->vtype == VALUE_REAL)
 			log_debug ("got value for field '%s': %lld",
@@ -291,172 +613,607 @@ field_response (int request, int code, struct snmp_value *value, void *arg)
 			           item->field);
 	}
 
+	/*
+	 * The match of a query pair may be in another packet, and still
+	 * out. Keep the value until query_match_response() checks it.
+	 */
+	if (code == SNMP_ERR_NOERROR && item->query_request)
+		return;
+
 	complete_requests (item, code);
+}
+
+static void
+field_response (int request, int code, struct snmp_value *value, void *arg)
+{
+	rb_item *item = arg;
+	mstime when;
+
+	ASSERT (request == item->field_request);
+	item->field_request = 0;
+
+	when = server_get_time ();
+	field_value (item, code, value, when);
 
 	/* If the entire poll is done, then complete it */
 	finish_poll (item->poller, when);
 }
 
 static void
-field_request (rb_item *item)
+field_batch_response (int code, struct snmp_batch *batch, int count, void *arg)
 {
-	int req;
-
-	ASSERT (item);
-	ASSERT (!item->field_request);
+	rb_poller *poll = arg;
+	rb_item *item;
+	mstime when;
+	int i;
 
-	item->vtype = VALUE_UNSET;
+	when = server_get_time ();
+	for (i = 0; i < count; ++i) {
+		item = batch[i].cookie;
+		ASSERT (item->poller == poll);
+		ASSERT (batch[i].request == item->field_request);
+		item->field_request = 0;
+		field_value (item, code, batch[i].value, when);
+	}
 
-	req = snmp_engine_request (item->hostnames[item->hostindex], item->portnum, item->community,
-	                           item->version, item->poller->interval, item->poller->timeout,
-	                           SNMP_PDU_GET, &item->field_oid, field_response, item);
-	item->field_request = req;
+	/* Only check the entire poll once for the lot */
+	finish_poll (poll, when);
 }
 
-/* Forward declaration */
-static void query_search_request (rb_item *item);
-
 static void
-query_value_request (rb_item *item, asn_subid_t subid)
+field_batch_request (rb_poller *poll, struct snmp_batch *batch, int count)
 {
-	struct asn_oid oid;
-	int req;
+	rb_item *item;
+	int i;
 
-	ASSERT (item);
-	ASSERT (item->has_query);
-	ASSERT (!item->query_request);
-	ASSERT (!item->field_request);
+	if (!count)
+		return;
 
-	item->vtype = VALUE_UNSET;
+	/* All the items in a batch have the same host */
+	item = batch[0].cookie;
+	snmp_engine_batch (item->host, poll->interval, poll->timeout,
+	                   batch, count, field_batch_response, poll);
 
-	/* OID for the actual value */
-	oid = item->field_oid;
-	ASSERT (oid.len < ASN_MAXOIDLEN);
-	oid.subs[oid.len] = subid;
-	++oid.len;
+	for (i = 0; i < count; ++i) {
+		item = batch[i].cookie;
+		item->field_request = batch[i].request;
+		item_sent (item);
+	}
+}
+
+/*
+ * With hedge turned on, fields still waiting at the usual response time
+ * of the poller are also requested from another alternate host. Which
+ * ever answers first is used.
+ */
+
+static void
+hedge_response (int request, int code, struct snmp_value *value, void *arg)
+{
+	rb_item *item = arg;
+	mstime when;
 
-	log_debug ("query requesting value for table index: %u", subid);
+	ASSERT (request == item->hedge_request);
+	item->hedge_request = 0;
 
-	req = snmp_engine_request (item->hostnames[item->hostindex], item->portnum, item->community,
-	                           item->version, item->poller->interval, item->poller->timeout,
-	                           SNMP_PDU_GET, &oid, field_response, item);
+	if (code == SNMP_ERR_NOERROR)
+		log_debug ("hedged request for field '%s' answered first", item->field);
 
-	/* Value retrieval is active */
-	item->field_request = req;
+	when = server_get_time ();
+	field_value (item, code, value, when);
+
+	finish_poll (item->poller, when);
 }
 
 static void
-query_next_response (int request, int code, struct snmp_value *value, void *arg)
+hedge_request (rb_item *item)
 {
-	rb_item *item = arg;
-	asn_subid_t subid;
-	int matched;
+	rb_poller *poll = item->poller;
+	int host;
 
-	/*
-	 * Called when we get the next OID in a table
-	 */
+	host = item_alternate (item, item->hostindex);
+	if (host < 0)
+		return;
 
-	ASSERT (request == item->query_request);
-	ASSERT (!item->field_request);
+	log_debug ("hedging request for field '%s': %s", item->field,
+	           item->hostnames[host]);
 
-	/* Mark this item as done */
-	item->query_request = 0;
+	item->hedge_request = snmp_engine_host_request (item->hosts[host], poll->interval,
+	                                                poll->timeout, SNMP_PDU_GET,
+	                                                &item->field_oid, hedge_response, item);
+}
 
-	if (code == SNMP_ERR_NOERROR) {
-		ASSERT (value);
+static int
+poller_hedge (mstime when, void *arg)
+{
+	rb_poller *poll = (rb_poller*)arg;
+	rb_item *item;
 
-		/* Convert these result codes into 'not found' */
-		switch (value->syntax) {
-		case SNMP_SYNTAX_NOSUCHOBJECT:
-		case SNMP_SYNTAX_NOSUCHINSTANCE:
-		case SNMP_SYNTAX_ENDOFMIBVIEW:
-			code = SNMP_ERR_NOSUCHNAME;
-			break;
+	/* Already complete, or from an earlier poll */
+	if (!poll->polling || when < poll->hedge_at)
+		return 0;
 
-		/*
-		 * Make sure that we haven't gone past the end. For it to
-		 * be in the table it must be exactly one longer (the table index)
-		 * and otherwise identical.
-		 */
-		default:
-			if (item->query_oid.len + 1 != value->var.len ||
-			    !asn_is_suboid (&item->query_oid, &value->var))
-				code = SNMP_ERR_NOSUCHNAME;
-			break;
-		};
+	for (item = poll->items; item; item = item->next) {
+		if (item->field_request && !item->hedge_request &&
+		    !item->has_query && item->n_hostnames > 1)
+			hedge_request (item);
 	}
 
-	if (code == SNMP_ERR_NOSUCHNAME)
-		log_debug ("query couldn't find table index that matches: %s",
-		           item->query_match ? item->query_match : "[null]");
+	snmp_engine_flush ();
+	return 0; /* unrepeated */
+}
 
+static void
+poller_hedge_at (rb_poller *poll, mstime when)
+{
+	mstime latency;
 
-	/* Problems communicating with the server, or not found */
-	if (code != SNMP_ERR_NOERROR) {
-		memset (&item->query_last, 0, sizeof (item->query_last));
-		complete_requests (item, code);
+	if (!latency_percentile (poll, 95, &latency) || latency >= poll->timeout)
 		return;
-	}
+	if (latency < 1)
+		latency = 1;
 
-	/* Save away the last OID we've seen */
-	item->query_last = value->var;
-	item->query_searched = 1;
+	poll->hedge_at = when + latency;
+	if (server_timer (latency, poller_hedge, poll) == -1)
+		log_errorx ("couldn't setup hedge timer");
+}
 
-	ASSERT (value);
+/* -----------------------------------------------------------------------------
+ * TABLE INDEXES
+ */
+
+/* Writes out a table index in dotted form */
+static void
+index_string (const asn_subid_t *index, int len, char *buf, size_t size)
+{
+	size_t at;
+	int i;
+
+	ASSERT (size > 0);
+	buf[0] = 0;
+
+	for (i = 0, at = 0; i < len && at < size; ++i)
+		at += snprintf (buf + at, size - at, i ? ".%u" : "%u", index[i]);
+}
+
+/* The OID of a column at the table index of a row in another column */
+static void
+index_oid (struct asn_oid *oid, const struct asn_oid *column,
+           const struct asn_oid *other, const struct asn_oid *row)
+{
+	u_int i;
+
+	ASSERT (asn_is_suboid (other, row));
+
+	*oid = *column;
+	for (i = other->len; i < row->len && oid->len < ASN_MAXOIDLEN; ++i)
+		oid->subs[oid->len++] = row->subs[i];
+}
+
+/* -----------------------------------------------------------------------------
+ * SHARED TABLE INDEXES
+ */
+
+/*
+ * Items that query the same table column on the same host share one walk
+ * of that column. The rows found are kept until a query notices that an
+ * index no longer matches, and then the column is walked again.
+ */
+
+struct table_key
+{
+	snmp_host *host;
+	struct asn_oid oid;
+};
+
+typedef struct _rb_table
+{
+	/* The hash key, host handle and query OID */
+	struct table_key key;
+
+	/* The rows of the column in walk order */
+	struct snmp_value *rows;
+	int n_rows;
+	int a_rows;
+
+	/* String values to their row number plus one, first one wins */
+	hsh_t *by_string;
+	int all_strings;
+
+	/* Table indexes to their row number plus one */
+	hsh_t *by_index;
+
+	/* The walk of the column */
+	int walk;
+	mstime walked;
+
+	/* Items waiting for the walk to complete */
+	rb_item *waiting;
+
+	/* Next in list of tables */
+	struct _rb_table *next;
+}
+rb_table;
+
+/* The hash key for the table index of a row */
+#define TABLE_INDEX_KEY(table, row) \
+	((row)->var.subs + (table)->key.oid.len), \
+	(((row)->var.len - (table)->key.oid.len) * sizeof (asn_subid_t))
+
+static rb_table *table_list = NULL;
+static hsh_t *table_by_key = NULL;
+
+static void
+table_clear (rb_table *table)
+{
+	int i;
+
+	/* The hash tables have keys in the rows */
+	hsh_clear (table->by_string);
+	hsh_clear (table->by_index);
+
+	for (i = 0; i < table->n_rows; ++i)
+		snmp_value_clear (&table->rows[i]);
+	table->n_rows = 0;
+	table->all_strings = 1;
+	table->walked = 0;
+}
+
+static rb_table*
+table_instance (rb_item *item)
+{
+	struct table_key key;
+	rb_table *table;
+
+	/* Zero any padding, since the whole thing is hashed */
+	memset (&key, 0, sizeof (key));
+	key.host = item->host;
+	key.oid = item->query_oid;
+
+	/* Either we have one for this host and column already */
+	table = hsh_get (table_by_key, &key, sizeof (key));
+	if (table)
+		return table;
+
+	/* Or it's new, and lives as long as the poll engine */
+	table = calloc (1, sizeof (rb_table));
+	if (table) {
+		memcpy (&table->key, &key, sizeof (key));
+		table->by_string = hsh_create ();
+		table->by_index = hsh_create ();
+	}
+	if (!table || !table->by_string || !table->by_index ||
+	    !hsh_set (table_by_key, &table->key, sizeof (table->key), table)) {
+		log_errorx ("out of memory");
+		if (table && table->by_string)
+			hsh_free (table->by_string);
+		if (table && table->by_index)
+			hsh_free (table->by_index);
+		free (table);
+		return NULL;
+	}
+
+	table->all_strings = 1;
+	table->next = table_list;
+	table_list = table;
+	return table;
+}
+
+static void
+table_add_row (rb_table *table, struct snmp_value *value)
+{
+	struct snmp_value *row;
+	struct snmp_value *rows;
+	int n;
+
+	/* Only rows of this column, with a table index */
+	if (value->var.len <= table->key.oid.len)
+		return;
+
+	if (table->n_rows == table->a_rows) {
+		n = table->a_rows ? table->a_rows * 2 : 16;
+		rows = realloc (table->rows, sizeof (struct snmp_value) * n);
+		if (!rows) {
+			log_errorx ("out of memory");
+			return;
+		}
+		table->rows = rows;
+		table->a_rows = n;
+	}
+
+	row = &table->rows[table->n_rows];
+	if (snmp_value_copy (row, value) < 0) {
+		log_errorx ("out of memory");
+		return;
+	}
+
+	n = ++table->n_rows;
 
-	/* Match the query value received */
-	if (item->query_match)
-		matched = snmp_engine_match (value, item->query_match);
+	/* The keys point into the row's own copy */
+	if (!hsh_set (table->by_index, TABLE_INDEX_KEY (table, row), (void*)(intptr_t)n))
+		log_errorx ("out of memory");
+
+	if (row->syntax != SNMP_SYNTAX_OCTETSTRING || !row->v.octetstring.len) {
+		table->all_strings = 0;
+	} else if (!hsh_get (table->by_string, row->v.octetstring.octets, row->v.octetstring.len)) {
+		if (!hsh_set (table->by_string, row->v.octetstring.octets,
+		              row->v.octetstring.len, (void*)(intptr_t)n))
+			table->all_strings = 0;
+	}
+}
+
+static struct snmp_value*
+table_find (rb_table *table, const char *match)
+{
+	intptr_t n;
+	int i;
+
+	if (!table->n_rows)
+		return NULL;
 
 	/* When query match is null, anything matches */
+	if (!match)
+		return &table->rows[0];
+
+	/* Only strings in this column, so look it up */
+	if (table->all_strings) {
+		n = (intptr_t)hsh_get (table->by_string, match, strlen (match));
+		return n ? &table->rows[n - 1] : NULL;
+	}
+
+	for (i = 0; i < table->n_rows; ++i) {
+		if (snmp_engine_match (&table->rows[i], match))
+			return &table->rows[i];
+	}
+
+	return NULL;
+}
+
+static struct snmp_value*
+table_row (rb_table *table, const asn_subid_t *index, int len)
+{
+	intptr_t n;
+
+	n = (intptr_t)hsh_get (table->by_index, index, len * sizeof (asn_subid_t));
+	return n ? &table->rows[n - 1] : NULL;
+}
+
+/* Forward declarations */
+static void query_value_request (rb_item *item);
+static void query_pair_request (rb_item *item);
+static void column_labelled (rb_item *item, rb_table *table, int code);
+
+static void
+table_result (rb_item *item, rb_table *table, int code)
+{
+	struct snmp_value *row;
+
+	/* Columns use the table for their labels */
+	if (item->is_column) {
+		column_labelled (item, table, code);
+		return;
+	}
+
+	/* Problems communicating with the server */
+	if (code != SNMP_ERR_NOERROR) {
+		memset (&item->query_last, 0, sizeof (item->query_last));
+		complete_requests (item, code);
+		return;
+	}
+
+	row = table_find (table, item->query_match);
+	if (!row) {
+		log_debug ("query couldn't find table index that matches: %s",
+		           item->query_match ? item->query_match : "[null]");
+		memset (&item->query_last, 0, sizeof (item->query_last));
+		complete_requests (item, SNMP_ERR_NOSUCHNAME);
+		return;
+	}
+
+	item->query_last = row->var;
+
+	/*
+	 * A table walked before this poll may be out of date, so check the
+	 * match along with the value. query_match_response() looks again
+	 * when the index has moved.
+	 */
+	if (table->walked < item->last_request) {
+		query_pair_request (item);
+		return;
+	}
+
+	/* Do a query for the field value at this table index */
+	item->query_matched = 1;
+	query_value_request (item);
+}
+
+static void
+table_complete (rb_table *table, int code)
+{
+	rb_item *item, *waiting;
+	mstime when;
+
+	when = server_get_time ();
+
+	/* Let every waiting item know */
+	waiting = table->waiting;
+	table->waiting = NULL;
+	for (item = waiting; item; item = item->query_next) {
+		ASSERT (item->query_table == table);
+		item->query_table = NULL;
+		table_result (item, table, code);
+	}
+
+	/* Items that didn't find anything may have been the last of their poll */
+	while (waiting) {
+		item = waiting;
+		waiting = item->query_next;
+		item->query_next = NULL;
+		if (item->poller->polling)
+			finish_poll (item->poller, when);
+	}
+}
+
+static void
+table_leave (rb_item *item)
+{
+	rb_table *table = item->query_table;
+	rb_item **at;
+
+	ASSERT (table);
+
+	for (at = &table->waiting; *at; at = &(*at)->query_next) {
+		if (*at == item) {
+			*at = item->query_next;
+			break;
+		}
+	}
+
+	item->query_table = NULL;
+	item->query_next = NULL;
+
+	/* Nobody is waiting any more, the next lookup starts over */
+	if (!table->waiting && table->walk) {
+		snmp_engine_walk_cancel (table->walk);
+		table->walk = 0;
+		table_clear (table);
+	}
+}
+
+static void
+table_walk_response (int walk, int code, struct snmp_value *values, int count, void *arg)
+{
+	rb_table *table = arg;
+	int i;
+
+	ASSERT (walk == table->walk);
+
+	/* Save away the rows as they come */
+	if (code == SNMP_ERR_NOERROR && count) {
+		for (i = 0; i < count; ++i)
+			table_add_row (table, &values[i]);
+		return;
+	}
+
+	table->walk = 0;
+
+	/* Problems communicating with the server */
+	if (code != SNMP_ERR_NOERROR)
+		table_clear (table);
 	else
-		matched = 1;
+		log_debug ("query found %d table indexes", table->n_rows);
 
-	item->query_matched = matched;
+	table_complete (table, code);
+}
+
+static int
+table_walk (rb_table *table, rb_item *item)
+{
+	ASSERT (!table->walk);
+
+	table_clear (table);
+	table->walked = server_get_time ();
+
+	log_debug ("query walking table indexes");
+
+	table->walk = snmp_engine_walk (item->host, item->poller->interval, item->poller->timeout,
+	                                &table->key.oid, table_walk_response, table);
+	return table->walk != 0;
+}
+
+static void
+table_wait (rb_table *table, rb_item *item)
+{
+	ASSERT (table->walk);
+	ASSERT (!item->query_table);
+
+	item->query_table = table;
+	item->query_next = table->waiting;
+	table->waiting = item;
+}
+
+static void
+table_lookup (rb_item *item)
+{
+	rb_table *table;
+
+	ASSERT (item);
+	ASSERT (item->has_query);
+	ASSERT (!item->query_request);
+	ASSERT (!item->field_request);
+	ASSERT (!item->query_table);
+
+	item->query_matched = 0;
 	item->vtype = VALUE_UNSET;
 
-	if (matched) {
-		/* Do a query for the field value with this sub id */
-		subid = value->var.subs[value->var.len - 1];
-		query_value_request (item, subid);
-	} else {
-		/* Look for the next table index */
-		query_search_request (item);
+	table = table_instance (item);
+	if (!table) {
+		table_result (item, NULL, -1);
+		return;
+	}
+
+	if (!table->walk) {
+
+		/* Another item may have walked the table already */
+		if (table->walked >= item->last_request || table_find (table, item->query_match)) {
+			table_result (item, table, SNMP_ERR_NOERROR);
+			return;
+		}
+
+		/* Otherwise walk it */
+		if (!table_walk (table, item)) {
+			table_result (item, table, -1);
+			return;
+		}
 	}
+
+	/* Wait for the walk to complete */
+	table_wait (table, item);
 }
 
 static void
-query_search_request (rb_item *item)
+table_invalidate (rb_item *item)
 {
-	struct asn_oid *oid;
+	rb_table *table;
+
+	/* The indexes changed, everyone needs to look again */
+	table = table_instance (item);
+	if (table && !table->walk)
+		table_clear (table);
+}
+
+/* -----------------------------------------------------------------------------
+ * QUERIES
+ */
+
+static void
+query_value_request (rb_item *item)
+{
+	char buf[ASN_OIDSTRLEN];
+	struct asn_oid oid;
 	int req;
 
 	ASSERT (item);
 	ASSERT (item->has_query);
 	ASSERT (!item->query_request);
 	ASSERT (!item->field_request);
+	ASSERT (item->query_last.len);
 
-	item->query_matched = 0;
 	item->vtype = VALUE_UNSET;
 
-	/* Start with the OID without any table index */
-	if (!item->query_searched) {
-		oid = &item->query_oid;
-		memset (&item->query_last, 0, sizeof (item->query_last));
-		log_debug ("query looking for first table index");
+	/* OID for the actual value */
+	index_oid (&oid, &item->field_oid, &item->query_oid, &item->query_last);
 
-	/* Go for the next one in the search */
-	} else {
-		ASSERT (item->query_last.len > 0);
-		oid = &item->query_last;
-		log_debug ("query looking for next table index");
-	}
+	index_string (item->query_last.subs + item->query_oid.len,
+	              item->query_last.len - item->query_oid.len, buf, sizeof (buf));
+	log_debug ("query requesting value for table index: %s", buf);
 
-	req = snmp_engine_request (item->hostnames[item->hostindex], item->portnum, item->community,
-	                           item->version, item->poller->interval, item->poller->timeout,
-	                           SNMP_PDU_GETNEXT, oid, query_next_response, item);
+	req = snmp_engine_host_request (item->host, item->poller->interval, item->poller->timeout,
+	                                SNMP_PDU_GET, &oid, field_response, item);
 
-	item->query_request = req;
+	/* Value retrieval is active */
+	item->field_request = req;
+	item_sent (item);
 }
 
 static void
@@ -511,8 +1268,14 @@ query_match_response (int request, int code, struct snmp_value *value, void *arg
 	}
 
 	item->query_matched = matched;
-	if (matched)
+	if (matched) {
+		item_sent (item);
+
+		/* The value may have arrived first, and been the last of the poll */
+		if (item->poller->polling)
+			finish_poll (item->poller, server_get_time ());
 		return;
+	}
 
 	log_debug ("query previous index did not match: %s",
 	           item->query_match ? item->query_match : "[null]");
@@ -524,12 +1287,14 @@ query_match_response (int request, int code, struct snmp_value *value, void *arg
 	if (item->field_request)
 		snmp_engine_cancel (item->field_request);
 	item->field_request = 0;
-	query_search_request (item);
+	table_invalidate (item);
+	table_lookup (item);
 }
 
 static void
-query_pair_request (rb_item *item, asn_subid_t subid)
+query_pair_request (rb_item *item)
 {
+	char buf[ASN_OIDSTRLEN];
 	struct asn_oid oid;
 	int req;
 
@@ -537,37 +1302,33 @@ query_pair_request (rb_item *item, asn_subid_t subid)
 	ASSERT (item->has_query);
 	ASSERT (!item->query_request);
 	ASSERT (!item->field_request);
+	ASSERT (item->query_last.len);
 
-	log_debug ("query requesting match and value pair for index: %u", subid);
+	index_string (item->query_last.subs + item->query_oid.len,
+	              item->query_last.len - item->query_oid.len, buf, sizeof (buf));
+	log_debug ("query requesting match and value pair for index: %s", buf);
 
 	item->vtype = VALUE_UNSET;
 	item->query_matched = 0;
 
 	/* OID for the value to match */
-	oid = item->query_oid;
-	ASSERT (oid.len < ASN_MAXOIDLEN);
-	oid.subs[oid.len] = subid;
-	++oid.len;
+	oid = item->query_last;
 
-	req = snmp_engine_request (item->hostnames[item->hostindex], item->portnum, item->community,
-	                           item->version, item->poller->interval, item->poller->timeout,
-	                           SNMP_PDU_GET, &oid, query_match_response, item);
+	req = snmp_engine_host_request (item->host, item->poller->interval, item->poller->timeout,
+	                                SNMP_PDU_GET, &oid, query_match_response, item);
 
 	/* Query is active */
 	item->query_request = req;
 
 	/* OID for the actual value */
-	oid = item->field_oid;
-	ASSERT (oid.len < ASN_MAXOIDLEN);
-	oid.subs[oid.len] = subid;
-	++oid.len;
+	index_oid (&oid, &item->field_oid, &item->query_oid, &item->query_last);
 
-	req = snmp_engine_request (item->hostnames[item->hostindex], item->portnum, item->community,
-	                           item->version, item->poller->interval, item->poller->timeout,
-	                           SNMP_PDU_GET, &oid, field_response, item);
+	req = snmp_engine_host_request (item->host, item->poller->interval, item->poller->timeout,
+	                                SNMP_PDU_GET, &oid, field_response, item);
 
 	/* Value retrieval is active */
 	item->field_request = req;
+	item_sent (item);
 }
 
 static void
@@ -577,7 +1338,6 @@ query_request (rb_item *item)
 	ASSERT (!item->query_request);
 	ASSERT (!item->field_request);
 
-	item->query_searched = 0;
 	item->query_matched = 0;
 	item->vtype = VALUE_UNSET;
 
@@ -591,24 +1351,538 @@ query_request (rb_item *item)
 		 * Doing this in one request is more efficient, then we check if the
 		 * match value matches the query in the response.
 		 */
-		query_pair_request (item, item->query_last.subs[item->query_last.len - 1]);
+		query_pair_request (item);
 
 	} else {
 
 		/*
-		 * We don't have a last matching table index, so start the search.
-		 * For indexes. We'll then query each of those indexes with the two
-		 * part request, as above.
+		 * We don't have a last matching table index, so look it up in the
+		 * table indexes for this host, which may need to be walked first.
+		 * Next time we use the two part request, as above.
 		 */
-		query_search_request (item);
+		table_lookup (item);
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * COLUMNS
+ */
+
+/*
+ * A column item walks all the rows of its column each poll, and has a
+ * value for each. Rows are labelled by their table index, or with a query
+ * by the value in the query column. A query with a match value instead
+ * only keeps the rows that match, labelled by table index.
+ */
+
+/* Labels are looked up again at least every so many polls */
+#define COLUMN_LABEL_POLLS 10
+
+static void
+column_label (rb_row *row, struct snmp_value *value)
+{
+	char *t;
+	size_t len;
+
+	switch (value ? value->syntax : SNMP_SYNTAX_NULL) {
+	case SNMP_SYNTAX_OCTETSTRING:
+		len = value->v.octetstring.len;
+		if (len >= sizeof (row->label))
+			len = sizeof (row->label) - 1;
+		memcpy (row->label, value->v.octetstring.octets, len);
+		row->label[len] = 0;
+		break;
+	case SNMP_SYNTAX_INTEGER:
+		snprintf (row->label, sizeof (row->label), "%d", value->v.integer);
+		break;
+	case SNMP_SYNTAX_COUNTER:
+	case SNMP_SYNTAX_GAUGE:
+	case SNMP_SYNTAX_TIMETICKS:
+		snprintf (row->label, sizeof (row->label), "%u", value->v.uint32);
+		break;
+	default:
+		row->label[0] = 0;
+		break;
+	};
+
+	/* Fall back to the table index */
+	if (!row->label[0])
+		index_string (row->index, row->index_len, row->label, sizeof (row->label));
+
+	/* Labels end up in references, so keep them tame */
+	for (t = row->label; *t; ++t) {
+		if (!isalnum (*t) && !strchr ("-_.", *t))
+			*t = '_';
 	}
 }
 
+static void
+column_rows (rb_item *item, struct snmp_value *values, int count)
+{
+	char asnbuf[ASN_OIDSTRLEN];
+	struct snmp_value *value;
+	rb_row *rows, *row;
+	int i, n, vtype;
+
+	for (i = 0; i < count; ++i) {
+		value = &values[i];
+
+		n = value->var.len - item->field_oid.len;
+		if (n <= 0 || n > MAX_ROW_INDEX) {
+			log_warnx ("snmp server %s: oid %s: field %s: table index too long",
+			           item->hostnames[item->hostindex],
+			           asn_oid2str_r (&value->var, asnbuf), item->field);
+			continue;
+		}
+
+		if (item->n_rows == item->a_rows) {
+			n = item->a_rows ? item->a_rows * 2 : 16;
+			rows = realloc (item->rows, sizeof (rb_row) * n);
+			if (!rows) {
+				log_errorx ("out of memory");
+				return;
+			}
+			item->rows = rows;
+			item->a_rows = n;
+		}
+
+		row = &item->rows[item->n_rows];
+		row->index_len = value->var.len - item->field_oid.len;
+		memcpy (row->index, value->var.subs + item->field_oid.len,
+		        row->index_len * sizeof (asn_subid_t));
+
+		row->vtype = VALUE_UNSET;
+		vtype = parse_value (value, &row->v);
+		if (vtype >= 0)
+			row->vtype = vtype;
+		else
+			log_warnx ("snmp server %s: oid %s: field %s: response %s(%u)",
+			           item->hostnames[item->hostindex],
+			           asn_oid2str_r (&value->var, asnbuf), item->field,
+			           snmp_get_syntaxmsg (value->syntax), value->syntax);
+
+		column_label (row, NULL);
+		++item->n_rows;
+	}
+}
+
+static void
+column_labelled (rb_item *item, rb_table *table, int code)
+{
+	struct snmp_value *label;
+	rb_row *row;
+	int i, n;
+
+	/* Can't label anything, so no rows at all */
+	if (code != SNMP_ERR_NOERROR) {
+		item->n_rows = 0;
+		complete_requests (item, code);
+		return;
+	}
+
+	for (i = 0, n = 0; i < item->n_rows; ++i) {
+		row = &item->rows[i];
+		label = table_row (table, row->index, row->index_len);
+
+		/* Only the rows that match, when asked */
+		if (item->query_match) {
+			if (!label || !snmp_engine_match (label, item->query_match))
+				continue;
+
+		/* A row we don't know about, table is out of date */
+		} else if (!label) {
+			continue;
+		} else {
+			column_label (row, label);
+		}
+
+		if (n != i)
+			memcpy (&item->rows[n], row, sizeof (rb_row));
+		++n;
+	}
+
+	log_debug ("column '%s' has %d rows, %d labelled", item->field, item->n_rows, n);
+	item->n_rows = n;
+
+	complete_requests (item, code);
+}
+
+static void
+column_labels (rb_item *item)
+{
+	rb_table *table;
+	mstime when;
+	int i, stale;
+
+	table = table_instance (item);
+	if (!table) {
+		column_labelled (item, NULL, -1);
+		return;
+	}
+
+	if (!table->walk) {
+
+		/* Walk the labels when they're old, or don't cover all rows */
+		when = server_get_time ();
+		stale = !table->walked ||
+		        when - table->walked > item->poller->interval * COLUMN_LABEL_POLLS;
+		for (i = 0; !stale && i < item->n_rows; ++i) {
+			if (!table_row (table, item->rows[i].index, item->rows[i].index_len))
+				stale = 1;
+		}
+
+		/* Unless it's been walked during this poll */
+		if (!stale || table->walked >= item->last_request) {
+			column_labelled (item, table, SNMP_ERR_NOERROR);
+			return;
+		}
+
+		if (!table_walk (table, item)) {
+			column_labelled (item, table, -1);
+			return;
+		}
+	}
+
+	/* Wait for the walk to complete */
+	table_wait (table, item);
+}
+
+static void
+column_response (int walk, int code, struct snmp_value *values, int count, void *arg)
+{
+	rb_item *item = arg;
+	mstime when;
+
+	ASSERT (walk == item->column_walk);
+
+	/* More rows */
+	if (code == SNMP_ERR_NOERROR && count) {
+		column_rows (item, values, count);
+		return;
+	}
+
+	/* Note when the column was complete */
+	when = server_get_time ();
+	item->last_polled = polled_time (item->last_request, when);
+	item->column_walk = 0;
+
+	/* Problems communicating with the server, no rows */
+	if (code != SNMP_ERR_NOERROR) {
+		item->n_rows = 0;
+		complete_requests (item, code);
+
+	/* Rows need labels from the query column */
+	} else if (item->has_query) {
+		column_labels (item);
+
+	} else {
+		log_debug ("column '%s' has %d rows", item->field, item->n_rows);
+		complete_requests (item, code);
+	}
+
+	/* If the entire poll is done, then complete it */
+	if (item->poller->polling)
+		finish_poll (item->poller, when);
+}
+
+static void
+column_request (rb_item *item)
+{
+	ASSERT (item);
+	ASSERT (item->is_column);
+	ASSERT (!item->column_walk);
+
+	item->n_rows = 0;
+	item->column_walk = snmp_engine_walk (item->host, item->poller->interval,
+	                                      item->poller->timeout, &item->field_oid,
+	                                      column_response, item);
+	if (!item->column_walk)
+		complete_requests (item, -1);
+}
+
+/* -----------------------------------------------------------------------------
+ * DISCOVERY
+ */
+
+/*
+ * A discovery item walks its table every so often, and makes a plain item
+ * for each row found. These are polled like any other item, and removed
+ * again when their row disappears. The table is walked along the query
+ * column when there is one, or the field column otherwise. Rows are
+ * labelled just like the rows of column items.
+ */
+
+static const struct asn_oid*
+discover_column (rb_item *item)
+{
+	return item->has_query ? &item->query_oid : &item->field_oid;
+}
+
+static void
+discover_rows (rb_item *item, struct snmp_value *values, int count)
+{
+	const struct asn_oid *column;
+	struct snmp_value *value;
+	rb_row *rows, *row;
+	int i, n;
+
+	column = discover_column (item);
+
+	for (i = 0; i < count; ++i) {
+		value = &values[i];
+
+		/* Each row gets an item polling the field at its index */
+		n = value->var.len - column->len;
+		if (n <= 0 || n > MAX_ROW_INDEX ||
+		    item->field_oid.len + n > ASN_MAXOIDLEN)
+			continue;
+
+		/* Only the rows that match, when asked */
+		if (item->query_match && !snmp_engine_match (value, item->query_match))
+			continue;
+
+		if (item->n_rows == item->a_rows) {
+			n = item->a_rows ? item->a_rows * 2 : 16;
+			rows = realloc (item->rows, sizeof (rb_row) * n);
+			if (!rows) {
+				log_errorx ("out of memory");
+				return;
+			}
+			item->rows = rows;
+			item->a_rows = n;
+		}
+
+		row = &item->rows[item->n_rows++];
+		row->index_len = value->var.len - column->len;
+		memcpy (row->index, value->var.subs + column->len,
+		        row->index_len * sizeof (asn_subid_t));
+		row->vtype = VALUE_UNSET;
+
+		/* Labelled by the query column value, unless matching on it */
+		column_label (row, item->has_query && !item->query_match ? value : NULL);
+	}
+}
+
+static void
+discover_item (rb_item *item, rb_row *row)
+{
+	rb_item *disc;
+
+	disc = malloc (sizeof (rb_item));
+	if (!disc) {
+		log_errorx ("out of memory");
+		return;
+	}
+
+	/* Same field, hosts and poller as the discovering item */
+	memcpy (disc, item, sizeof (rb_item));
+	disc->is_discover = 0;
+	disc->discover_walk = 0;
+	disc->last_discovered = 0;
+	disc->discovered_by = item;
+	disc->rows = NULL;
+	disc->n_rows = disc->a_rows = 0;
+
+	/* A plain field at the index of the row */
+	disc->has_query = 0;
+	disc->query_match = NULL;
+	disc->query_matched = 0;
+	disc->query_request = 0;
+	disc->query_table = NULL;
+	disc->query_next = NULL;
+	disc->field_request = 0;
+	disc->hedge_request = 0;
+	disc->rate_at = 0;
+	disc->written_at = 0;
+	disc->column_walk = 0;
+	disc->pending = 0;
+	memcpy (disc->field_oid.subs + disc->field_oid.len, row->index,
+	        row->index_len * sizeof (asn_subid_t));
+	disc->field_oid.len += row->index_len;
+
+	strncpy (disc->label, row->label, sizeof (disc->label));
+	disc->label[sizeof (disc->label) - 1] = 0;
+
+	disc->last_request = disc->last_polled = 0;
+	disc->vtype = VALUE_UNSET;
+
+	log_debug ("discovered item for field '%s': %s", disc->field, disc->label);
+
+	/* Goes right after the discovering item */
+	disc->next = item->next;
+	item->next = disc;
+}
+
+static void
+discover_complete (rb_item *item)
+{
+	rb_item **at, *disc;
+	hsh_t *found;
+	rb_row *row;
+	int i, removed = 0;
+
+	found = hsh_create ();
+	if (!found) {
+		log_errorx ("out of memory");
+		return;
+	}
+
+	for (i = 0; i < item->n_rows; ++i) {
+		row = &item->rows[i];
+		if (!hsh_set (found, row->index, row->index_len * sizeof (asn_subid_t), row)) {
+			log_errorx ("out of memory");
+			hsh_free (found);
+			return;
+		}
+	}
+
+	/* Items with a row that's still around stay, the rest go */
+	at = &item->poller->items;
+	while (*at) {
+		disc = *at;
+		if (disc->discovered_by != item) {
+			at = &disc->next;
+			continue;
+		}
+
+		row = hsh_rem (found, disc->field_oid.subs + item->field_oid.len,
+		               (disc->field_oid.len - item->field_oid.len) * sizeof (asn_subid_t));
+		if (row) {
+			/* The label can change for the same row */
+			strncpy (disc->label, row->label, sizeof (disc->label));
+			disc->label[sizeof (disc->label) - 1] = 0;
+			at = &disc->next;
+			continue;
+		}
+
+		log_debug ("removing discovered item for field '%s': %s",
+		           disc->field, disc->label);
+
+		/* Not counted first, so nothing is written for it */
+		item_done (disc);
+		if (ITEM_BUSY (disc))
+			complete_requests (disc, SNMP_ERR_NOERROR);
+		*at = disc->next;
+		free (disc);
+		++removed;
+	}
+
+	/* And rows that are new get an item */
+	for (i = 0; i < item->n_rows; ++i) {
+		row = &item->rows[i];
+		if (hsh_get (found, row->index, row->index_len * sizeof (asn_subid_t)))
+			discover_item (item, row);
+	}
+
+	log_debug ("discovery for field '%s' found %d rows, %u new, %d removed",
+	           item->field, item->n_rows, hsh_count (found), removed);
+
+	hsh_free (found);
+}
+
+static void
+discover_response (int walk, int code, struct snmp_value *values, int count, void *arg)
+{
+	rb_item *item = arg;
+	mstime when;
+
+	ASSERT (walk == item->discover_walk);
+
+	/* More rows */
+	if (code == SNMP_ERR_NOERROR && count) {
+		discover_rows (item, values, count);
+		return;
+	}
+
+	item->discover_walk = 0;
+
+	/* Keep the items we have, and try again next time */
+	if (code != SNMP_ERR_NOERROR) {
+		log_debug ("discovery for field '%s' failed", item->field);
+		item->last_discovered = 0;
+		complete_requests (item, code);
+		return;
+	}
+
+	discover_complete (item);
+
+	/* Removed items may have been all that the poll was waiting for */
+	when = server_get_time ();
+	if (item->poller->polling)
+		finish_poll (item->poller, when);
+}
+
+static void
+discover_request (rb_item *item, mstime when)
+{
+	ASSERT (item);
+	ASSERT (item->is_discover);
+
+	/* Runs less often than the polls, and in the background */
+	if (item->discover_walk)
+		return;
+	if (item->last_discovered && when - item->last_discovered < item->discover_interval)
+		return;
+
+	item->last_discovered = when;
+	item->n_rows = 0;
+
+	item->discover_walk = snmp_engine_walk (item->host, item->poller->interval,
+	                                        item->poller->timeout,
+	                                        (struct asn_oid*)discover_column (item),
+	                                        discover_response, item);
+}
+
+/*
+ * Once the timeout is up, the values we have are written out rather than
+ * waiting for the next poll to force them. Not when packets may wait on
+ * throttles, since time spent waiting doesn't count towards the timeout.
+ */
+
+static int poller_deadline (mstime when, void *arg);
+
+static void
+poller_deadline_at (rb_poller *poll, mstime when)
+{
+	/* Only one timer at a time, it reschedules itself for later polls */
+	if (poll->deadline_pending)
+		return;
+
+	if (server_timer (poll->deadline - when, poller_deadline, poll) == -1) {
+		log_errorx ("couldn't setup deadline timer");
+		return;
+	}
+
+	poll->deadline_pending = 1;
+}
+
+static int
+poller_deadline (mstime when, void *arg)
+{
+	rb_poller *poll = (rb_poller*)arg;
+
+	poll->deadline_pending = 0;
+
+	/* Already complete */
+	if (!poll->polling)
+		return 0;
+
+	/* A later poll, that isn't due yet */
+	if (when < poll->deadline)
+		poller_deadline_at (poll, when);
+	else
+		force_poll (poll, when, "timed out");
+
+	return 0; /* unrepeated */
+}
+
 static int
 poller_timer (mstime when, void *arg)
 {
 	rb_poller *poll = (rb_poller*)arg;
+	struct snmp_batch batch[MAX_BATCH];
 	rb_item *item;
+	int count = 0;
 
 	/*
 	 * If the previous poll has not completed, then we count it
@@ -616,6 +1890,13 @@ poller_timer (mstime when, void *arg)
 	 */
 	force_poll (poll, when, "timed out");
 
+	/* Another peer polls this one */
+	if (poll->idle)
+		return 1;
+
+	/* The timeout learned from the last polls */
+	latency_timeout (poll);
+
 	/* Mark this poller as starting requests now */
 	poll->last_request = when;
 	ASSERT (!poll->polling);
@@ -627,23 +1908,255 @@ poller_timer (mstime when, void *arg)
 	 */
 	for (item = poll->items; item; item = item->next) {
 		item->last_request = when;
-		if (item->has_query)
+		if (item->is_discover) {
+			discover_request (item, when);
+			continue;
+		}
+
+		/* Counted until the item has its value */
+		ASSERT (!item->pending);
+		item->pending = 1;
+		++poll->outstanding;
+		if (item->n_hostnames > 1)
+			item_choose (item, -1);
+		if (snmp_engine_host_down (item->host)) {
+			host_down (item, when);
+			continue;
+		}
+		if (item->is_column) {
+			column_request (item);
+			continue;
+		}
+		if (item->has_query) {
 			query_request (item);
-		else
-			field_request (item);
+			continue;
+		}
+
+		/* Plain fields for the same host go to the engine in one batch */
+		if (count == MAX_BATCH ||
+		    (count && ((rb_item*)batch[count - 1].cookie)->host != item->host)) {
+			field_batch_request (poll, batch, count);
+			count = 0;
+		}
+
+		ASSERT (!item->field_request);
+		item->vtype = VALUE_UNSET;
+		batch[count].oid = &item->field_oid;
+		batch[count].cookie = item;
+		++count;
 	}
 
+	field_batch_request (poll, batch, count);
 	snmp_engine_flush ();
 
+	/* Nothing could be sent, or everything was known already */
+	if (poll->polling && !poll->outstanding)
+		finish_poll (poll, when);
+
+	/* Write out what we have at the deadline, unless the next poll comes first */
+	if (poll->polling && !g_state.throttle && !g_state.pace_rate && !poll->throttle) {
+		/* Not before the engine has given up on the retries */
+		poll->deadline = when + snmp_engine_lifetime (poll->interval, poll->timeout);
+		if (g_state.pace_percent)
+			poll->deadline += (poll->interval * g_state.pace_percent) / 100;
+		if (poll->deadline < when + poll->interval)
+			poller_deadline_at (poll, when);
+
+		/* With pacing, response times say little about the host */
+		if (poll->hedge && !g_state.pace_percent)
+			poller_hedge_at (poll, when);
+	}
+
 	return 1;
 }
 
+/* -----------------------------------------------------------------------------
+ * PHASES
+ */
+
+/*
+ * Each poller is given a phase, its offset into the interval from wall
+ * clock time. These are packed so that the packets expected are spread
+ * evenly over the seconds of a period where all intervals repeat. The
+ * same configuration always results in the same phases.
+ */
+
+#define PHASE_SLOT      1000            /* Phases are in whole seconds */
+#define PHASE_PERIOD    3600            /* The most slots that are packed */
+#define PHASE_ROWS      10              /* Lines in the histogram */
+#define PHASE_BAR       40
+
+struct phase {
+	rb_poller *poll;
+	uint load;
+	uint hash;
+};
+
+static uint
+phase_hash (const char *key)
+{
+	uint hash = 2166136261U;
+
+	/* FNV-1a, so that ties go the same way on every restart */
+	while (*key) {
+		hash ^= (unsigned char)*(key++);
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static uint
+phase_load (rb_poller *poll)
+{
+	rb_item *item;
+	snmp_host *host = NULL;
+	uint bindings = 0;
+	uint load = 0;
+
+	/* Packets for each run of items on the same host */
+	for (item = poll->items; item; item = item->next) {
+		if (item->host != host) {
+			load += (bindings + SNMP_MAX_BINDINGS - 1) / SNMP_MAX_BINDINGS;
+			bindings = 0;
+			host = item->host;
+		}
+		bindings += item->has_query && !item->is_column ? 2 : 1;
+	}
+
+	load += (bindings + SNMP_MAX_BINDINGS - 1) / SNMP_MAX_BINDINGS;
+	return load;
+}
+
+static int
+phase_compare (const void *a, const void *b)
+{
+	const struct phase *pa = a;
+	const struct phase *pb = b;
+
+	/* Biggest first, then in order of key */
+	if (pa->load != pb->load)
+		return pa->load > pb->load ? -1 : 1;
+	return strcmp (pa->poll->key, pb->poll->key);
+}
+
+static uint
+phase_slots (mstime interval)
+{
+	uint slots = interval / PHASE_SLOT;
+	return slots ? slots : 1;
+}
+
+static void
+phase_histogram (uint *slots, uint period)
+{
+	char bar[PHASE_BAR + 1];
+	uint row, rows, i, from, to;
+	uint total, most = 0;
+
+	rows = period < PHASE_ROWS ? period : PHASE_ROWS;
+
+	for (row = 0; row < rows; ++row) {
+		for (i = row * period / rows, total = 0; i < (row + 1) * period / rows; ++i)
+			total += slots[i];
+		if (total > most)
+			most = total;
+	}
+
+	for (row = 0; row < rows; ++row) {
+		from = row * period / rows;
+		to = (row + 1) * period / rows;
+		for (i = from, total = 0; i < to; ++i)
+			total += slots[i];
+
+		i = most ? (total * PHASE_BAR + most - 1) / most : 0;
+		memset (bar, '#', i);
+		bar[i] = 0;
+
+		log_info ("poll phases %4us-%4us: %6u packets %s", from, to, total, bar);
+	}
+}
+
+static void
+phase_assign (void)
+{
+	struct phase *phases;
+	rb_poller *poll;
+	uint *slots;
+	uint n, i, j, k, p;
+	uint period, interval, start;
+	uint cost, best, sum, best_sum, phase;
+	uint a, b, t;
+
+	for (poll = g_state.polls, n = 0; poll != NULL; poll = poll->next)
+		++n;
+	if (!n)
+		return;
+
+	/* All the intervals repeat over this period, unless it's huge */
+	period = 1;
+	for (poll = g_state.polls; poll != NULL; poll = poll->next) {
+		interval = phase_slots (poll->interval);
+		for (a = period, b = interval; b; t = a % b, a = b, b = t);
+		if ((period / a) * interval > PHASE_PERIOD) {
+			period = PHASE_PERIOD;
+			break;
+		}
+		period = (period / a) * interval;
+	}
+
+	phases = calloc (n, sizeof (struct phase));
+	slots = calloc (period, sizeof (uint));
+	if (!phases || !slots)
+		err (1, "out of memory");
+
+	for (poll = g_state.polls, i = 0; poll != NULL; poll = poll->next, ++i) {
+		phases[i].poll = poll;
+		phases[i].load = phase_load (poll);
+		phases[i].hash = phase_hash (poll->key);
+	}
+
+	qsort (phases, n, sizeof (struct phase), phase_compare);
+
+	/* Each into the phase whose busiest slot is least busy */
+	for (i = 0; i < n; ++i) {
+		interval = phase_slots (phases[i].poll->interval);
+		start = phases[i].hash % interval;
+		best = best_sum = ~0U;
+		phase = start;
+
+		for (j = 0; j < interval; ++j) {
+			p = (start + j) % interval;
+			cost = sum = 0;
+			for (k = p; k < period; k += interval) {
+				sum += slots[k];
+				if (slots[k] > cost)
+					cost = slots[k];
+			}
+			if (cost < best || (cost == best && sum < best_sum)) {
+				best = cost;
+				best_sum = sum;
+				phase = p;
+			}
+		}
+
+		for (k = phase; k < period; k += interval)
+			slots[k] += phases[i].load;
+		phases[i].poll->phase = (mstime)phase * PHASE_SLOT;
+	}
+
+	phase_histogram (slots, period);
+
+	free (phases);
+	free (slots);
+}
+
 void
 rb_poll_engine_init (void)
 {
 	/*
-	 * Randomly start all timers with a small random offset of between
-	 * 0-interval time. This spreads the polls out over a few seconds.
+	 * Start all timers at their phase into the interval, see above.
+	 * This spreads the polls out evenly, the same way each time.
 	 */
 	rb_poller * poll;
 	struct timeval now;
@@ -651,16 +2164,34 @@ rb_poll_engine_init (void)
 	    err(1, "gettimeofday failed");
 	}
 
+	table_by_key = hsh_create ();
+	if (!table_by_key)
+		err (1, "out of memory");
+
+	/* What we knew before a restart, before any hosts are looked up */
+	rb_persist_init ();
+
 	for (poll = g_state.polls; poll != NULL; poll = poll->next) {
-	        struct timeval start, offset;
-		int offset_ms;
+		rb_item *item;
 
-		offset_ms = rand() % poll->interval;
-		offset.tv_sec = offset_ms / 1000;
-		offset.tv_usec = (offset_ms % 1000) * 1000;
+		for (item = poll->items; item; item = item->next)
+			item_host (item);
+	}
+
+	phase_assign ();
+
+	for (poll = g_state.polls; poll != NULL; poll = poll->next) {
+	        struct timeval start;
+		mstime current, next;
 
-		start = now;
-		timeradd(&start, &offset, &start);
+		/* The next time that's at the phase, from the epoch */
+		current = (mstime)now.tv_sec * 1000 + now.tv_usec / 1000;
+		next = current - (current % poll->interval) + poll->phase;
+		if (next < current)
+			next += poll->interval;
+
+		start.tv_sec = next / 1000;
+		start.tv_usec = (next % 1000) * 1000;
 
 		if (server_timer_at(start, poll->interval, poller_timer, poll) == -1)
 		    err(1, "couldn't setup timer");
@@ -671,18 +2202,47 @@ void
 rb_poll_engine_uninit (void)
 {
 	rb_poller * poll = g_state.polls;
+	rb_table *table;
 	rb_item *item;
 	mstime when;
 
+	/* Save what we know for next time */
+	rb_persist_save ();
+
 	if (poll != NULL) {
 		/* Now see if the all the requests are done */
 		when = server_get_time ();
 		for (item = poll->items; item; item = item->next) {
-			if (item->field_request || item->query_request) {
+			if (ITEM_BUSY (item)) {
 				cancel_requests (item, when, "shutdown");
 			}
-			ASSERT (!item->field_request);
-			ASSERT (!item->query_request);
+			ASSERT (!ITEM_BUSY (item));
+		}
+	}
+
+	/* Discovery goes on in the background */
+	for (poll = g_state.polls; poll != NULL; poll = poll->next) {
+		for (item = poll->items; item; item = item->next) {
+			if (item->discover_walk)
+				snmp_engine_walk_cancel (item->discover_walk);
+			item->discover_walk = 0;
 		}
 	}
+
+	/* And the shared table indexes */
+	while (table_list) {
+		table = table_list;
+		table_list = table->next;
+		if (table->walk)
+			snmp_engine_walk_cancel (table->walk);
+		table_clear (table);
+		hsh_free (table->by_string);
+		hsh_free (table->by_index);
+		free (table->rows);
+		free (table);
+	}
+
+	if (table_by_key)
+		hsh_free (table_by_key);
+	table_by_key = NULL;
 }
@@ -49,93 +49,345 @@
 #define MAX_NUMLEN 40
 #define RAW_BUFLEN 768
 
-static void write_sample(int, const time_t*, const rb_item*, const char*);
+/* The reference on the line that ends each poll, when streaming */
+#define RAW_END_MARKER "*"
+
+static void aggregate(rb_poller*);
+static void mark_unchanged(rb_item*);
+static void write_item(int, const char*, const rb_item*, const char*);
+static void write_sample(int, const char*, const char*, int, const rb_value*, const char*);
+static void write_aggregate(int, const char*, const char*, const char*, int, const rb_value*, const char*);
+static void write_line(int, const char*, int, const char*);
+
+/* Opens the raw file for the time, returns -1 on failure */
+static int
+open_raw(file_path *rawpath, mstime when, time_t *time, char *path, size_t size)
+{
+    struct tm *timeinfo;
+    size_t len;
+    int fd;
+
+    /* time expects seconds */
+    *time = when / 1000L;
+    timeinfo = localtime(time);
+    len = strftime(path, size, rawpath->path, timeinfo);
+
+    if(len == 0)
+    {
+        log_errorx("raw file: %s: strftime: %s", rawpath->path, strerror(errno));
+        return -1;
+    }
+
+    log_debug ("updating RAW file: %s -> %s", rawpath->path, path);
+
+    if((fd = open(path, O_WRONLY|O_APPEND|O_CREAT, 0644)) == -1)
+    {
+        log_errorx("raw file: %s: open: %s", path, strerror(errno));
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Timestamps have milliseconds when polled more often than each second */
+static void
+format_stamp(char *stamp, size_t size, rb_poller *poll, mstime when)
+{
+    if(poll->interval % 1000 == 0)
+        snprintf(stamp, size, "%"PRId64, (int64_t)(when / 1000L));
+    else
+        snprintf(stamp, size, "%"PRId64".%03u", (int64_t)(when / 1000L),
+                 (unsigned)(when % 1000L));
+}
+
+static void
+close_raw(int fd, const char *path)
+{
+    if (close(fd) == -1)
+    {
+        log_errorx("raw file: %s: close: %s", path, strerror(errno));
+    }
+}
 
 void rb_rrd_update(rb_poller *poll)
 {
     rb_item *item;
     file_path *rawpath;
+    char path[MAXPATHLEN];
+    char buf[RAW_BUFLEN];
+    char stamp[MAX_NUMLEN];
+    time_t time;
+    int fd, n;
 
     if(!poll->items)
         return;
 
+    if(poll->aggregate)
+        aggregate(poll);
+
+    /* Decided once for all the raw files */
+    if(!poll->stream) {
+        for(item = poll->items; item; item = item->next)
+            mark_unchanged(item);
+    }
+
     /* Loop through all the attached raw files */
     for(rawpath = poll->rawlist; rawpath; rawpath = rawpath->next) {
+
+        /* Items went out as they came, so only mark the end of the poll */
+        if(poll->stream) {
+            fd = open_raw(rawpath, poll->last_polled, &time, path, sizeof(path));
+            if(fd == -1)
+                continue;
+            format_stamp(stamp, sizeof(stamp), poll, poll->last_polled);
+            n = snprintf(buf, sizeof(buf), "%s\t%s\t\n", stamp, RAW_END_MARKER);
+            write_line(fd, buf, n, path);
+            close_raw(fd, path);
+            continue;
+        }
+
         for(item = poll->items; item; item = item->next) {
-            char path[MAXPATHLEN];
-            int fd;
-            struct tm *timeinfo;
-            time_t time;
-            size_t len;
-
-            /* time expects seconds */
-            time = item->last_polled / 1000L;
-            timeinfo = localtime(&time);
-            len = strftime(path, sizeof(path), rawpath->path, timeinfo);
-
-            if(len == 0)
-            {
-                log_errorx("raw file: %s: strftime: %s", rawpath->path, strerror(errno));
+            if(item->unchanged)
+                continue;
+
+            fd = open_raw(rawpath, item->last_polled, &time, path, sizeof(path));
+            if(fd == -1)
                 break; /* next raw file */
-            }
 
-            log_debug ("updating RAW file: %s -> %s", rawpath->path, path);
+            format_stamp(stamp, sizeof(stamp), poll, item->last_polled);
+            write_item(fd, stamp, item, path /* for logging */);
+            close_raw(fd, path);
+        }
+    }
+}
 
-            if((fd = open(path, O_WRONLY|O_APPEND|O_CREAT, 0644)) == -1)
-            {
-                log_errorx("raw file: %s: open: %s", path, strerror(errno));
-                break; /* next raw file */
-            }
+void rb_rrd_update_item(rb_poller *poll, rb_item *item)
+{
+    file_path *rawpath;
+    char path[MAXPATHLEN];
+    char stamp[MAX_NUMLEN];
+    time_t time;
+    int fd;
+
+    format_stamp(stamp, sizeof(stamp), poll, item->last_polled);
+    mark_unchanged(item);
+    if(item->unchanged)
+        return;
+
+    for(rawpath = poll->rawlist; rawpath; rawpath = rawpath->next) {
+        fd = open_raw(rawpath, item->last_polled, &time, path, sizeof(path));
+        if(fd == -1)
+            continue;
+
+        write_item(fd, stamp, item, path /* for logging */);
+        close_raw(fd, path);
+    }
+}
+
+/*
+ * The min, avg and max of each field over a number of polls is written
+ * to the aggregate raw files, labelled after the reference. Columns are
+ * left out as their rows change from poll to poll.
+ */
+static void
+aggregate(rb_poller *poll)
+{
+    file_path *aggpath;
+    rb_item *item;
+    char path[MAXPATHLEN];
+    char base[RAW_BUFLEN / 4];
+    char stamp[MAX_NUMLEN];
+    const char *reference;
+    rb_value v;
+    time_t time;
+    double value;
+    int fd, vtype;
+
+    for(item = poll->items; item; item = item->next) {
+        if(item->is_discover || item->is_column)
+            continue;
+        if(item->discovered_by && !item->last_request)
+            continue;
+
+        if(item->vtype == VALUE_UNSET)
+            continue;
+        value = item->vtype == VALUE_REAL ? (double)item->v.i_value : item->v.f_value;
+
+        if(!item->agg_count || value < item->agg_min)
+            item->agg_min = value;
+        if(!item->agg_count || value > item->agg_max)
+            item->agg_max = value;
+        item->agg_sum += value;
+        item->agg_count++;
+    }
+
+    if(++poll->aggregated < poll->aggregate)
+        return;
+    poll->aggregated = 0;
 
-            write_sample(fd, &time, item, path /* for logging */);
+    format_stamp(stamp, sizeof(stamp), poll, poll->last_polled);
 
-            if (close(fd) == -1)
-            {
-                log_errorx("raw file: %s: close: %s", path, strerror(errno));
-            }
+    for(aggpath = poll->agglist; aggpath; aggpath = aggpath->next) {
+        fd = open_raw(aggpath, poll->last_polled, &time, path, sizeof(path));
+        if(fd == -1)
+            continue;
+
+        for(item = poll->items; item; item = item->next) {
+            if(item->is_discover || item->is_column)
+                continue;
+            if(item->discovered_by && !item->last_request)
+                continue;
+
+            reference = item->reference ? item->reference : item->field;
+            if(item->discovered_by)
+                snprintf(base, sizeof(base), "%s.%s", reference, item->label);
+            else
+                snprintf(base, sizeof(base), "%s", reference);
+
+            /* Nothing arrived during all these polls */
+            vtype = item->agg_count ? VALUE_FLOAT : VALUE_UNSET;
+
+            v.f_value = item->agg_min;
+            write_aggregate(fd, stamp, base, "min", vtype, &v, path);
+            v.f_value = item->agg_count ? item->agg_sum / item->agg_count : 0;
+            write_aggregate(fd, stamp, base, "avg", vtype, &v, path);
+            v.f_value = item->agg_max;
+            write_aggregate(fd, stamp, base, "max", vtype, &v, path);
         }
+
+        close_raw(fd, path);
+    }
+
+    for(item = poll->items; item; item = item->next) {
+        item->agg_min = item->agg_max = item->agg_sum = 0;
+        item->agg_count = 0;
     }
 }
 
+/*
+ * Fields with a heartbeat are only written when their value changes,
+ * or when the heartbeat has passed since it was last written.
+ */
 static void
-write_sample(int fd, const time_t *time, const rb_item *item, const char* fd_path)
+mark_unchanged(rb_item *item)
+{
+    int same;
+
+    item->unchanged = 0;
+
+    if(!item->heartbeat || item->is_discover || item->is_column)
+        return;
+    if(item->discovered_by && !item->last_request)
+        return;
+
+    same = item->written_at && item->vtype == item->written_vtype;
+    if(same && item->vtype == VALUE_REAL)
+        same = item->v.i_value == item->written_v.i_value;
+    else if(same && item->vtype == VALUE_FLOAT)
+        same = item->v.f_value == item->written_v.f_value;
+
+    if(same && item->last_polled - item->written_at < item->heartbeat) {
+        item->unchanged = 1;
+        return;
+    }
+
+    item->written_v = item->v;
+    item->written_vtype = item->vtype;
+    item->written_at = item->last_polled;
+}
+
+static void
+write_item(int fd, const char *stamp, const rb_item *item, const char* fd_path)
+{
+    char reference[RAW_BUFLEN / 2];
+    const char *base;
+    int i;
+
+    base = item->reference ? item->reference : item->field;
+
+    /* Only the items it creates have values */
+    if (item->is_discover)
+        return;
+
+    /* Same as the last written, see mark_unchanged() */
+    if (item->unchanged)
+        return;
+
+    /* Labelled after the reference like a column row */
+    if (item->discovered_by) {
+        /* Discovered during this poll, and not polled yet */
+        if (!item->last_request)
+            return;
+
+        snprintf(reference, sizeof(reference), "%s.%s", base, item->label);
+        write_sample(fd, stamp, reference, item->vtype, &item->v, fd_path);
+        return;
+    }
+
+    if (!item->is_column) {
+        write_sample(fd, stamp, base, item->vtype, &item->v, fd_path);
+        return;
+    }
+
+    /* A line for each row of a column, labelled after the reference */
+    for (i = 0; i < item->n_rows; ++i) {
+        snprintf(reference, sizeof(reference), "%s.%s", base, item->rows[i].label);
+        write_sample(fd, stamp, reference, item->rows[i].vtype, &item->rows[i].v, fd_path);
+    }
+}
+
+static void
+write_sample(int fd, const char *stamp, const char *reference, int vtype,
+             const rb_value *v, const char* fd_path)
 {
     char buf[RAW_BUFLEN];
-    ssize_t nw;
     int n;
 
-    switch (item->vtype) {
+    switch (vtype) {
     case VALUE_REAL:
-        n = snprintf(buf, sizeof(buf), "%"PRId64"\t%s\t%"PRId64"\n",
-          *time,
-          (item->reference ? item->reference : item->field),
-          item->v.i_value);
+        n = snprintf(buf, sizeof(buf), "%s\t%s\t%"PRId64"\n",
+          stamp, reference, v->i_value);
         break;
 
     case VALUE_FLOAT:
-        n = snprintf(buf, sizeof(buf), "%"PRId64"\t%s\t%.4lf\n",
-          *time,
-          (item->reference ? item->reference : item->field),
-          item->v.f_value);
+        n = snprintf(buf, sizeof(buf), "%s\t%s\t%.4lf\n",
+          stamp, reference, v->f_value);
         break;
 
     case VALUE_UNSET:
-        n = snprintf(buf, sizeof(buf), "%"PRId64"\t%s\t\n",
-          *time,
-          (item->reference ? item->reference : item->field));
+        n = snprintf(buf, sizeof(buf), "%s\t%s\t\n",
+          stamp, reference);
         break;
 
     default:
-        log_errorx("raw file: %s: unknown sample value type: %d", fd_path, item->vtype);
+        log_errorx("raw file: %s: unknown sample value type: %d", fd_path, vtype);
         return;
     }
 
+    write_line(fd, buf, n, fd_path);
+}
+
+static void
+write_aggregate(int fd, const char *stamp, const char *base, const char *kind,
+                int vtype, const rb_value *v, const char* fd_path)
+{
+    char reference[RAW_BUFLEN / 2];
+
+    snprintf(reference, sizeof(reference), "%s.%s", base, kind);
+    write_sample(fd, stamp, reference, vtype, v, fd_path);
+}
+
+static void
+write_line(int fd, const char *buf, int n, const char* fd_path)
+{
+    ssize_t nw;
+
     if (n == -1) {
         log_errorx("raw file: %s: snprintf: %s", fd_path, strerror(errno));
         return;
     }
 
-    if (n >= sizeof(buf)) {
+    if (n >= RAW_BUFLEN) {
         log_errorx("raw file: %s: truncated sample string: required: %d", fd_path, n);
         return;
     }
@@ -50,6 +50,7 @@
 #include <syslog.h>
 #include <signal.h>
 #include <err.h>
+#include <limits.h>
 
 #include <bsnmp/asn1.h>
 #include <bsnmp/snmp.h>
@@ -62,6 +63,12 @@
 #define DEFAULT_RETRIES     3
 #define DEFAULT_TIMEOUT     5
 
+/* The longest coalescing window in milliseconds */
+#define MAX_COALESCE        1000
+
+/* The most threads decoding packets */
+#define MAX_WORKERS         64
+
 /* -----------------------------------------------------------------------------
  * GLOBALS
  */
@@ -153,6 +160,8 @@ usage()
 {
     fprintf(stderr, "usage: rrdbotd [-M] [-c confdir] [-w workdir] [-m mibdir] \n");
     fprintf(stderr, "               [-d level] [-p pidfile] [-r retries] [-t timeout]\n");
+    fprintf(stderr, "               [-T throttle] [-P pace] [-W window] [-k polls]\n");
+    fprintf(stderr, "               [-S shard/shards] [-a address [-A peer ...]] [-j workers]\n");
     fprintf(stderr, "       rrdbotd -V\n");
     exit(2);
 }
@@ -206,10 +215,13 @@ main(int argc, char* argv[])
 {
 	const char** local = NULL;
 	int n_local = 0;
+	int n_peers = 0;
     const char* pidfile = NULL;
     int daemonize = 1;
     char ch;
     char* t;
+    long shard, shards;
+    long value;
 
 #ifdef TEST
     test(argc, argv);
@@ -225,11 +237,23 @@ main(int argc, char* argv[])
     g_state.timeout = DEFAULT_TIMEOUT;
 
     /* Parse the arguments nicely */
-    while((ch = getopt(argc, argv, "b:c:d:m:Mp:r:t:w:V")) != -1)
+    while((ch = getopt(argc, argv, "a:A:b:c:d:j:k:m:Mp:P:r:S:t:T:w:W:V")) != -1)
     {
         switch(ch)
         {
 
+        /* Address to hear from peers on, and our name to them */
+        case 'a':
+            g_state.peer_name = optarg;
+            break;
+
+        /* Other peers that share the polling */
+        case 'A':
+            g_state.peers = xrealloc(g_state.peers, sizeof(char*) * (n_peers + 2));
+            g_state.peers[n_peers] = optarg;
+            g_state.peers[++n_peers] = NULL;
+            break;
+
         /* Bind address */
         case 'b':
             local = xrealloc (local, sizeof (char*) * (n_local + 2));
@@ -266,6 +290,25 @@ main(int argc, char* argv[])
             pidfile = optarg;
             break;
 
+        /* Spread out new requests, packets per second or percent of interval */
+        case 'P':
+            value = strtol(optarg, &t, 10);
+            if(*t == '%' && !t[1])
+            {
+                if(value <= 0 || value > 100)
+                    errx(1, "invalid pace (percentage must be between 1 and 100): %s", optarg);
+                g_state.pace_percent = (uint)value;
+                g_state.pace_rate = 0;
+            }
+            else if(*t || value <= 0 || value > UINT_MAX)
+                errx(1, "invalid pace (must be above zero): %s", optarg);
+            else
+            {
+                g_state.pace_rate = (uint)value;
+                g_state.pace_percent = 0;
+            }
+            break;
+
         /* The number of SNMP retries */
         case 'r':
             g_state.retries = strtol(optarg, &t, 10);
@@ -280,11 +323,56 @@ main(int argc, char* argv[])
                 errx(1, "invalid timeout (must be above zero): %s", optarg);
             break;
 
+        /* Threads that decode SNMP packets */
+        case 'j':
+            g_state.workers = strtol(optarg, &t, 10);
+            if(*t || g_state.workers <= 0 || g_state.workers > MAX_WORKERS)
+                errx(1, "invalid number of workers (must be between 1 and %d): %s",
+                     MAX_WORKERS, optarg);
+            break;
+
+        /* Failed polls before a host is only probed */
+        case 'k':
+            value = strtol(optarg, &t, 10);
+            if(*t || value <= 0 || value > UINT_MAX)
+                errx(1, "invalid number of polls (must be above zero): %s", optarg);
+            g_state.breaker = (uint)value;
+            break;
+
+        /* Only poll one of the shards */
+        case 'S':
+            shards = 0;
+            shard = strtol(optarg, &t, 10);
+            if(*t == '/')
+                shards = strtol(t + 1, &t, 10);
+            if(*t || shards <= 0 || shards > UINT_MAX || shard <= 0 || shard > shards)
+                errx(1, "invalid shard (must be like 1/4): %s", optarg);
+            g_state.shard = (uint)(shard - 1);
+            g_state.shards = (uint)shards;
+            break;
+
+        /* Packets per second limit for all hosts together */
+        case 'T':
+            value = strtol(optarg, &t, 10);
+            if(*t || value <= 0 || value > UINT_MAX)
+                errx(1, "invalid throttle (must be above zero): %s", optarg);
+            g_state.throttle = (uint)value;
+            break;
+
         /* The work directory */
         case 'w':
             g_state.rrddir = optarg;
             break;
 
+        /* Milliseconds packets stay open to bindings from other pollers */
+        case 'W':
+            value = strtol(optarg, &t, 10);
+            if(*t || t == optarg || value < 0 || value > MAX_COALESCE)
+                errx(1, "invalid coalescing window (must be between 0 and %d): %s",
+                     MAX_COALESCE, optarg);
+            g_state.coalesce = (uint)value;
+            break;
+
         /* Print version number */
         case 'V':
             version();
@@ -304,6 +392,9 @@ main(int argc, char* argv[])
     if(argc != 0)
         usage();
 
+    if(g_state.peers && !g_state.peer_name)
+        errx(1, "peers need an address to hear from them on (-a)");
+
     /* No bind addresses specified, use defaults... */
     if (local == NULL) {
         local = xrealloc (local, sizeof (char*) * 3);
@@ -326,7 +417,12 @@ main(int argc, char* argv[])
 
     /* Rev up the main engine */
     snmp_engine_init (local, g_state.retries);
+    snmp_engine_throttle (NULL, g_state.throttle);
+    snmp_engine_pace (g_state.pace_rate, g_state.pace_percent);
+    snmp_engine_coalesce (g_state.coalesce);
+    snmp_engine_breaker (g_state.breaker);
     rb_poll_engine_init();
+    rb_peers_init();
 
     free (local);
     n_local = 0;
@@ -342,6 +438,9 @@ main(int argc, char* argv[])
         daemonized = 1;
     }
 
+    /* Threads don't survive becoming a daemon, so started here */
+    snmp_engine_workers(g_state.workers);
+
     /* Setup the Async DNS resolver */
     if(async_resolver_init() < 0)
     {
@@ -372,9 +471,11 @@ main(int argc, char* argv[])
     log_info("rrdbotd stopping");
 
     /* Cleanups */
+    rb_peers_uninit();
     rb_poll_engine_uninit();
     snmp_engine_stop();
     rb_config_free();
+    free(g_state.peers);
     async_resolver_uninit();
     server_uninit();
 
@@ -45,6 +45,7 @@
 #include "asn1.h"
 #include "snmp.h"
 #include "hash.h"
+#include "snmp-engine.h"
 
 /* -----------------------------------------------------------------------------
  * DATA
@@ -54,6 +55,34 @@ typedef uint64_t mstime;
 
 struct _rb_item;
 struct _rb_poller;
+struct _rb_table;
+
+typedef union _rb_value
+{
+    int64_t i_value;
+    double f_value;
+}
+rb_value;
+
+#define VALUE_UNSET 0
+#define VALUE_REAL  1
+#define VALUE_FLOAT 2
+
+/* One row of a column item, see below */
+typedef struct _rb_row
+{
+    /* The table index of the row, after the column OID */
+    #define MAX_ROW_INDEX 16
+    asn_subid_t index[MAX_ROW_INDEX];
+    int index_len;
+
+    /* Appended to the item reference */
+    char label[64];
+
+    rb_value v;
+    int vtype;
+}
+rb_row;
 
 /*
  * Note that all the members are either in the config memory
@@ -75,6 +104,7 @@ typedef struct _rb_item
     /* The oid that we are querying */
     struct asn_oid field_oid;
     int field_request;
+    int hedge_request;
 
     /* Host names, with alternate hosts */
     #define MAX_HOSTNAMES 16
@@ -83,29 +113,65 @@ typedef struct _rb_item
     int hostindex;
     int n_hostnames;
 
+    /* Engine handles for each host, and the current one */
+    snmp_host* hosts[MAX_HOSTNAMES];
+    snmp_host* host;
+
     /* Query related stuff */
     int has_query;
     struct asn_oid query_oid;
     const char* query_match;
     int query_matched;
-    int query_searched;
     struct asn_oid query_last;
     int query_request;
 
+    /* Waiting on a shared walk of the query table */
+    struct _rb_table* query_table;
+    struct _rb_item* query_next;
+
+    /* Polls a whole column, with one value per row */
+    int is_column;
+    int column_walk;
+    rb_row* rows;
+    int n_rows;
+    int a_rows;
+
+    /* Creates an item for each row found, rather than polling */
+    int is_discover;
+    mstime discover_interval;
+    mstime last_discovered;
+    int discover_walk;
+
+    /* For items created by discovery, see above */
+    struct _rb_item* discovered_by;
+    char label[64];
+
+    /* Written as a rate per second, with the last value polled */
+    int is_rate;
+    rb_value rate_last;
+    int rate_vtype;
+    mstime rate_at;
+
+    /* Only written when changed, or after the heartbeat, see rrd-update.c */
+    mstime heartbeat;
+    rb_value written_v;
+    int written_vtype;
+    mstime written_at;
+    int unchanged;
+
+    /* Summary of the polls since the last aggregate was written */
+    double agg_min;
+    double agg_max;
+    double agg_sum;
+    uint agg_count;
+
     /* Book keeping */
     mstime last_request;
     mstime last_polled;
+    int pending;
 
     /* The last value / current request */
-    union
-    {
-        int64_t i_value;
-        double f_value;
-    } v;
-
-    #define VALUE_UNSET 0
-    #define VALUE_REAL  1
-    #define VALUE_FLOAT 2
+    rb_value v;
     int vtype;
 
     /* Pointers to related */
@@ -133,14 +199,53 @@ typedef struct _rb_poller
     file_path* rrdlist;
     file_path* rawlist;
 
+    /* Raw files with the min, avg and max of every so many polls */
+    file_path* agglist;
+    uint aggregate;
+    uint aggregated;
+
     mstime interval;
     mstime timeout;
 
+    /* Bounds for a timeout learned from response times, or zero */
+    mstime timeout_min;
+    mstime timeout_max;
+
+    /* Recent response times, and the timeout last logged */
+    #define LATENCY_SAMPLES 64
+    mstime latency[LATENCY_SAMPLES];
+    uint n_latency;
+    mstime timeout_reported;
+
+    /* Offset of the polls into the interval, from the epoch */
+    mstime phase;
+
+    /* Packets per second limit for each host, or zero */
+    uint throttle;
+
+    /* Write each item as soon as it's done */
+    int stream;
+
+    /* Also ask another alternate host when responses are slow */
+    int hedge;
+    mstime hedge_at;
+
+    /* The agent of the first item, for sharing the polling */
+    const char* agent;
+
+    /* Polled by another peer, see peers.c */
+    int idle;
+
     /* The things to poll. rb_poller owns this list */
     rb_item* items;
 
-    /* Polling is active */
+    /* Polling is active, with items still outstanding */
     int polling;
+    int outstanding;
+
+    /* When an active poll is written out, even if incomplete */
+    mstime deadline;
+    int deadline_pending;
 
     /* Book keeping */
     mstime last_request;
@@ -158,6 +263,20 @@ typedef struct _rb_state
     const char* rrddir;
     uint retries;
     uint timeout;
+    uint throttle;
+    uint pace_rate;
+    uint pace_percent;
+    uint coalesce;
+    uint breaker;
+    uint workers;
+
+    /* This process only polls one of the shards, see config.c */
+    uint shard;
+    uint shards;
+
+    /* Peers that share the polling, named by their address */
+    const char* peer_name;
+    const char** peers;
 
     /* All the pollers/hosts */
     rb_poller* polls;
@@ -189,5 +308,20 @@ void rb_poll_engine_uninit();
  */
 
 void rb_rrd_update(rb_poller *poll);
+void rb_rrd_update_item(rb_poller *poll, rb_item *item);
+
+/* -----------------------------------------------------------------------------
+ * WARM START STATE (persist.c)
+ */
+
+void rb_persist_init();
+void rb_persist_save();
+
+/* -----------------------------------------------------------------------------
+ * SHARING WITH PEERS (peers.c)
+ */
+
+void rb_peers_init();
+void rb_peers_uninit();
 
 #endif /* __RRDBOTD_H__ */
@@ -0,0 +1,116 @@
+#!/bin/sh
+#
+# Measures how many fast pollers one rrdbotd process keeps up with.
+#
+# Generates a number of configuration files, each polling two values
+# from the given agent at a short interval, and runs rrdbotd on them
+# in the foreground for a while. Then reports the values written per
+# second, against the number that were due, and the CPU time used.
+#
+# The agent should be on the local network, or the loopback, so that
+# the time measured is mostly rrdbotd's own.
+#
+#   rrdbot-bench.sh [-n configs] [-i interval] [-s seconds] [-C community]
+#                   [-o oid] [-r rrdbotd] agent[:port] [-- rrdbotd options]
+#
+# For example, 1000 configurations at 250ms with a 20ms coalescing window:
+#
+#   rrdbot-bench.sh -n 1000 -i 250ms localhost:161 -- -W 20
+#
+
+CONFIGS=1000
+INTERVAL=250ms
+DURATION=30
+COMMUNITY=public
+OID=ifInOctets.1
+RRDBOTD=rrdbotd
+
+usage()
+{
+    echo "usage: rrdbot-bench.sh [-n configs] [-i interval] [-s seconds] [-C community]" >&2
+    echo "                       [-o oid] [-r rrdbotd] agent[:port] [-- rrdbotd options]" >&2
+    exit 2
+}
+
+while getopts "n:i:s:C:o:r:" ch; do
+    case $ch in
+    n) CONFIGS=$OPTARG ;;
+    i) INTERVAL=$OPTARG ;;
+    s) DURATION=$OPTARG ;;
+    C) COMMUNITY=$OPTARG ;;
+    o) OID=$OPTARG ;;
+    r) RRDBOTD=$OPTARG ;;
+    *) usage ;;
+    esac
+done
+shift `expr $OPTIND - 1`
+
+[ $# -ge 1 ] || usage
+AGENT=$1
+shift
+[ "$1" = "--" ] && shift
+
+# The interval in milliseconds, to work out how many values were due
+case $INTERVAL in
+*ms) MS=`echo $INTERVAL | sed 's/ms$//'` ;;
+*s) MS=`echo $INTERVAL | sed 's/s$//' | awk '{ print $1 * 1000 }'` ;;
+*) MS=`echo $INTERVAL | awk '{ print $1 * 1000 }'` ;;
+esac
+
+WORK=`mktemp -d "${TMPDIR:-/tmp}/rrdbot-bench.XXXXXX"` || exit 1
+trap 'rm -rf "$WORK"' 0 1 2 15
+mkdir "$WORK/conf" "$WORK/work"
+
+n=0
+while [ $n -lt $CONFIGS ]; do
+    cat > "$WORK/conf/bench$n.conf" <<EOF
+[general]
+raw: $WORK/work/bench$n.raw
+
+[poll]
+in.source: snmp2c://$COMMUNITY@$AGENT/$OID
+up.source: snmp2c://$COMMUNITY@$AGENT/sysUpTime.0
+interval: $INTERVAL
+EOF
+    n=`expr $n + 1`
+done
+
+# The CPU time used in milliseconds, while it's still running
+cputime()
+{
+    if [ -r /proc/$1/stat ]; then
+        sed 's/^.*) //' /proc/$1/stat | awk -v hz=`getconf CLK_TCK` '{ print ($12 + $13) * 1000 / hz }'
+    else
+        ps -o time= -p $1 | awk -F: '{ s = 0; for (i = 1; i <= NF; i++) s = s * 60 + $i; print s * 1000 }'
+    fi
+}
+
+"$RRDBOTD" -d1 -c "$WORK/conf" -w "$WORK/work" "$@" 2> "$WORK/rrdbotd.log" &
+PID=$!
+
+sleep $DURATION
+CPU=`cputime $PID`
+kill $PID
+wait $PID 2> /dev/null
+
+if ! ls "$WORK/work" | grep -q '\.raw$'; then
+    echo "rrdbotd didn't write anything:" >&2
+    cat "$WORK/rrdbotd.log" >&2
+    exit 1
+fi
+
+cat "$WORK/work/"*.raw 2> /dev/null | awk -F'\t' \
+    -v configs=$CONFIGS -v ms=$MS -v secs=$DURATION -v cpu=$CPU '
+    $3 != "" { values++ }
+    $3 == "" { unknown++ }
+    END {
+        due = configs * 2 * (secs * 1000 / ms)
+        printf "configs:       %d at %dms, two values each\n", configs, ms
+        printf "values due:    %d in %d seconds\n", due, secs
+        printf "values:        %d (%.1f%%), %.0f per second\n", values,
+               due ? values * 100 / due : 0, values / secs
+        printf "unknown:       %d\n", unknown
+        printf "cpu:           %.1f%% of one core\n", cpu / (secs * 10)
+    }'
+
+grep -i "error\|warning" "$WORK/rrdbotd.log" | sort | uniq -c | head -5